@@ -0,0 +1,154 @@
+/******************************************************************************
+                                                                              *
+ * Copyright (C) 2019 Fondazione Istituto Italiano di Tecnologia (IIT)        *
+ * All Rights Reserved.                                                       *
+                                                                              *
+                                                                              */
+
+/**
+ * @file src/common/convKernels.h
+ * @authors: Leandro de Souza Rosa <leandro.desouzarosa@iit.it>
+ */
+
+#ifndef __CONV_KERNELS_H
+#define __CONV_KERNELS_H
+
+#include <opencv2/core.hpp>
+
+#include <vector>
+#include <cmath>
+
+/*
+ * Per event and per frame kernels of liteConv and refConv, shared with
+ * convMicroBench so the benchmark measures the code the modules run. They
+ * only depend on OpenCV: E is any event with x, y and polarity (ev::AE or the
+ * benchmark events) and T the precision of the surfaces.
+ */
+
+/*
+ * LiteConv::run(), one pixel: decays its n images (one per alpha) from the
+ * SAE time to ts, adds the event and stamps the SAE.
+ */
+template<typename T, typename E>
+inline void litePixel(T &sae, T *img, const T *alphas, int n, const E &e, T ts)
+{
+    // the time since the last event is shared by all the alphas
+    T dt = sae - ts;
+    for(int k = 0; k < n; k++)
+    {
+        T decay = std::exp(alphas[k]*dt);
+        if(e.polarity)
+            img[k] = img[k]*decay + 1;
+        else
+            img[k] = img[k]*decay - 1;
+    }
+    sae = ts;
+}
+
+/*
+ * RefConv::run(), decay coefficients (alpha*dt) of the k x k patch of an
+ * event, then stamps the patch with ts. The surfaces are padded: (x, y) is
+ * the corner of the patch, not its centre.
+ */
+template<typename E>
+inline void refPatchCoefs(cv::Mat &sae, const E &e, int k, double alpha, double ts, cv::Mat &coefs)
+{
+    cv::Mat saePatch = sae(cv::Rect(e.x, e.y, k, k));
+    coefs = alpha*(saePatch - ts);
+    saePatch = ts;
+}
+
+/*
+ * refPatchCoefs() on an interleaved (sae, img) state: the SAE patch is
+ * gathered into the contiguous scratch while stamping it.
+ */
+template<typename T, typename E>
+inline void refPatchCoefsInterleaved(cv::Mat &state, const E &e, int k, double alpha, double ts,
+                                     cv::Mat &scratch, cv::Mat &coefs)
+{
+    for(int r = 0; r < k; r++)
+    {
+        cv::Vec<T, 2> *px = state.ptr<cv::Vec<T, 2>>(e.y + r) + e.x;
+        T *sp = scratch.ptr<T>(r);
+        for(int c = 0; c < k; c++)
+        {
+            sp[c] = px[c][0];
+            px[c][0] = static_cast<T>(ts);
+        }
+    }
+    coefs = alpha*(scratch - ts);
+}
+
+/*
+ * RefConv::run(), decays the image patch of an event and sums (or
+ * subtracts) the kernel.
+ */
+template<typename E>
+inline void refPatchApply(cv::Mat &img, const cv::Mat &kernel, const E &e, const cv::Mat &decay)
+{
+    cv::Mat img_window = img(cv::Rect(e.x, e.y, kernel.cols, kernel.rows));
+    if(e.polarity)
+        img_window = img_window.mul(decay) + kernel;
+    else
+        img_window = img_window.mul(decay) - kernel;
+}
+
+/*
+ * refPatchApply() on an interleaved (sae, img) state.
+ */
+template<typename T, typename E>
+inline void refPatchApplyInterleaved(cv::Mat &state, const cv::Mat &kernel, const E &e, const cv::Mat &decay)
+{
+    for(int r = 0; r < kernel.rows; r++)
+    {
+        cv::Vec<T, 2> *px = state.ptr<cv::Vec<T, 2>>(e.y + r) + e.x;
+        const T *dp = decay.ptr<T>(r);
+        const T *kp = kernel.ptr<T>(r);
+        for(int c = 0; c < kernel.cols; c++)
+        {
+            if(e.polarity)
+                px[c][1] = px[c][1]*dp[c] + kp[c];
+            else
+                px[c][1] = px[c][1]*dp[c] - kp[c];
+        }
+    }
+}
+
+/*
+ * Batched refConv: the decays of the first n events of a block, one row of
+ * k*k coefficients per event, in a single cv::exp pass.
+ */
+inline void refBlockDecays(const cv::Mat &batchCoefs, cv::Mat &batchDecay, int n)
+{
+    cv::Mat blockCoefs = batchCoefs.rowRange(0, n);
+    cv::Mat blockDecay = batchDecay.rowRange(0, n);
+    cv::exp(blockCoefs, blockDecay);
+}
+
+/*
+ * Snapshot threads, first step of the frame decay: time since the last
+ * event of each pixel, read once from the SAE for all the alphas.
+ */
+inline void frameDt(const cv::Mat &sae, double ts, cv::Mat &dt)
+{
+    cv::subtract(sae, ts, dt);
+}
+
+/*
+ * Snapshot threads, decays e^(alpha*dt) of each alpha. With a single alpha
+ * planes[0] may share the data of decays, otherwise the planes are merged
+ * into the channels of decays. The decayed image is then img.mul(decays).
+ */
+inline void frameDecays(const cv::Mat &dt, const double *alphas, int n, std::vector<cv::Mat> &planes, cv::Mat &decays)
+{
+    for(int k = 0; k < n; k++)
+    {
+        planes[k] = alphas[k]*dt;
+        cv::exp(planes[k], planes[k]);
+    }
+    if(n > 1)
+        cv::merge(planes, decays);
+}
+
+#endif
+//empty line to make gcc happy
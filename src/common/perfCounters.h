@@ -0,0 +1,205 @@
+/******************************************************************************
+                                                                              *
+ * Copyright (C) 2019 Fondazione Istituto Italiano di Tecnologia (IIT)        *
+ * All Rights Reserved.                                                       *
+                                                                              *
+                                                                              */
+
+/**
+ * @file src/common/perfCounters.h
+ * @authors: Leandro de Souza Rosa <leandro.desouzarosa@iit.it>
+ */
+
+#ifndef __PERF_COUNTERS_H
+#define __PERF_COUNTERS_H
+
+#include <yarp/os/all.h>
+
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cstdint>
+#include <cerrno>
+
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+/**
+ * @class PerfProfiler
+ * @brief Hardware counters (cycles, instructions, LLC and branch misses) of the calling thread
+ *
+ * The counters run as a single group for the whole life of the thread;
+ * start()/stop() read them around a section and accumulate the difference.
+ * Sections are registered once and reported per item (event or snapshot).
+ * If the group did not run all the time it was enabled (multiplexed with
+ * other perf users or the NMI watchdog), the counts are scaled up and the
+ * report says so; a group that never ran reports nothing.
+ *
+ * @file src/common/perfCounters.h
+ */
+class PerfProfiler {
+
+public:
+    enum {CYCLES, INSTRUCTIONS, LLC_MISSES, BRANCH_MISSES, N_COUNTERS};
+
+    explicit PerfProfiler(std::string m_label) : label(m_label) {}
+
+    ~PerfProfiler()
+    {
+        for(int i = 0; i < N_COUNTERS; i++)
+            if(fd[i] >= 0) close(fd[i]);
+    }
+
+    /*!
+     * Open the counters for the calling thread, must run on the profiled thread.
+     *
+     * \return bool true/false iff success/fail.
+     */
+    bool open()
+    {
+        static const uint64_t config[N_COUNTERS] = {
+            PERF_COUNT_HW_CPU_CYCLES,
+            PERF_COUNT_HW_INSTRUCTIONS,
+            PERF_COUNT_HW_CACHE_MISSES, // last level cache
+            PERF_COUNT_HW_BRANCH_MISSES
+        };
+
+        for(int i = 0; i < N_COUNTERS; i++)
+        {
+            perf_event_attr attr;
+            std::memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = config[i];
+            attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+            attr.disabled = i == 0; // the leader starts the whole group
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+
+            fd[i] = static_cast<int>(syscall(__NR_perf_event_open, &attr, 0, -1, i == 0 ? -1 : fd[0], 0));
+            if(fd[i] < 0)
+            {
+                yWarning() << label << ": perf_event_open failed (" << std::strerror(errno)
+                           << "), check /proc/sys/kernel/perf_event_paranoid - profiling disabled";
+                return false;
+            }
+        }
+
+        ioctl(fd[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+        ioctl(fd[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+        enabled = true;
+        return true;
+    }
+
+    /*!
+     * Register a section, returns the id used by stop().
+     */
+    int addSection(const std::string &name, const std::string &unit)
+    {
+        sections.push_back(Section{name, unit, {0}, 0, 0});
+        return static_cast<int>(sections.size()) - 1;
+    }
+
+    void start()
+    {
+        if(enabled) sample(begin);
+    }
+
+    /*!
+     * Accumulate the counts since start() in a section, covering n items.
+     */
+    void stop(int section, uint64_t n = 1)
+    {
+        if(!enabled) return;
+        uint64_t end[N_VALUES];
+        sample(end);
+        accumulate(section, n, end);
+    }
+
+    /*!
+     * stop() the current section and start() the next one with a single read.
+     */
+    void lap(int section, uint64_t n = 1)
+    {
+        if(!enabled) return;
+        uint64_t end[N_VALUES];
+        sample(end);
+        accumulate(section, n, end);
+        std::memcpy(begin, end, sizeof(begin));
+    }
+
+    void report() const
+    {
+        if(!enabled) return;
+        for(auto &s : sections)
+        {
+            if(!s.items) continue;
+            if(!s.counts[RUNNING])
+            {
+                yWarning() << label << "/" << s.name << ": the counters were never scheduled, no counts";
+                continue;
+            }
+            // estimate of the full counts when the group was multiplexed
+            double scale = static_cast<double>(s.counts[ENABLED])/s.counts[RUNNING];
+            if(s.counts[RUNNING] < s.counts[ENABLED])
+                yWarning() << label << "/" << s.name << ": the counters ran" << 100.0/scale
+                           << "% of the time, counts scaled by" << scale;
+            double n = static_cast<double>(s.items)/scale;
+            yInfo() << label << "/" << s.name << ":" << static_cast<double>(s.calls) << "calls," << static_cast<double>(s.items) << s.unit
+                    << "| per" << s.unit << ": cycles" << s.counts[CYCLES]/n
+                    << "instructions" << s.counts[INSTRUCTIONS]/n
+                    << "IPC" << (s.counts[CYCLES] ? static_cast<double>(s.counts[INSTRUCTIONS])/s.counts[CYCLES] : 0.0)
+                    << "LLC misses" << s.counts[LLC_MISSES]/n
+                    << "branch misses" << s.counts[BRANCH_MISSES]/n;
+        }
+    }
+
+private:
+    // times the group was enabled and running (ns), read with the counters
+    enum {ENABLED = N_COUNTERS, RUNNING, N_VALUES};
+
+    struct Section {
+        std::string name;
+        std::string unit;
+        uint64_t counts[N_VALUES];
+        uint64_t calls;
+        uint64_t items;
+    };
+
+    void accumulate(int section, uint64_t n, const uint64_t *end)
+    {
+        Section &s = sections[section];
+        for(int i = 0; i < N_VALUES; i++)
+            s.counts[i] += end[i] - begin[i];
+        s.calls++;
+        s.items += n;
+    }
+
+    void sample(uint64_t *values)
+    {
+        // on a failed read the section counts nothing
+        if(values != begin) std::memcpy(values, begin, sizeof(begin));
+        struct {
+            uint64_t nr;
+            uint64_t timeEnabled;
+            uint64_t timeRunning;
+            uint64_t values[N_COUNTERS];
+        } group;
+        if(read(fd[0], &group, sizeof(group)) != static_cast<ssize_t>(sizeof(group)))
+            return;
+        std::memcpy(values, group.values, sizeof(group.values));
+        values[ENABLED] = group.timeEnabled;
+        values[RUNNING] = group.timeRunning;
+    }
+
+    std::string label;
+    int fd[N_COUNTERS]{-1, -1, -1, -1};
+    bool enabled{false};
+    uint64_t begin[N_VALUES]{0};
+    std::vector<Section> sections;
+};
+
+#endif
+//empty line to make gcc happy
@@ -0,0 +1,183 @@
+/******************************************************************************
+                                                                              *
+ * Copyright (C) 2019 Fondazione Istituto Italiano di Tecnologia (IIT)        *
+ * All Rights Reserved.                                                       *
+                                                                              *
+                                                                              */
+
+/**
+ * @file src/common/preFilter.h
+ * @authors: Leandro de Souza Rosa <leandro.desouzarosa@iit.it>
+ */
+
+#ifndef __PRE_FILTER_H
+#define __PRE_FILTER_H
+
+#include <yarp/os/all.h>
+#include <event-driven/all.h>
+
+#include <vector>
+#include <cstdint>
+#include <limits>
+#include <algorithm> // std max
+
+#include "evbFile.h"
+
+/**
+ * @class PreFilter
+ * @brief The vPreProcess steps the modules need, run in the event thread
+ *
+ * A single pass over each packet flips the events (--flipx, --flipy), drops
+ * the noise: an event without any event in its 8 neighbours in the last
+ * --spatialFilter seconds, or an event less than --temporalFilter seconds
+ * after the last kept event of its pixel, and crops them to a region of
+ * interest (--roi "(x y width height)"). The spatial filter runs on the whole
+ * sensor, so the events around the region count as neighbours. The kept
+ * events are copied once, with the coordinates of the region of interest.
+ *
+ * @file src/common/preFilter.h
+ */
+class PreFilter {
+
+public:
+    /*!
+     * Read the steps from the command line, for a sensor of the given size.
+     *
+     * \return bool true/false iff success/fail.
+     */
+    bool configure(yarp::os::ResourceFinder &rf, unsigned int sensorWidth, unsigned int sensorHeight)
+    {
+        sWidth = static_cast<int>(sensorWidth);
+        sHeight = static_cast<int>(sensorHeight);
+        flipx = rf.check("flipx", yarp::os::Value(false)).asBool();
+        flipy = rf.check("flipy", yarp::os::Value(false)).asBool();
+        spatial = rf.check("spatialFilter", yarp::os::Value(0.0)).asFloat64();
+        temporal = rf.check("temporalFilter", yarp::os::Value(0.0)).asFloat64();
+
+        roiX = 0;
+        roiY = 0;
+        roiWidth = sWidth;
+        roiHeight = sHeight;
+        yarp::os::Bottle *roi = rf.find("roi").asList();
+        if(roi)
+        {
+            if(roi->size() != 4)
+            {
+                yError() << "--roi takes \"(x y width height)\"";
+                return false;
+            }
+            roiX = roi->get(0).asInt32();
+            roiY = roi->get(1).asInt32();
+            roiWidth = roi->get(2).asInt32();
+            roiHeight = roi->get(3).asInt32();
+            if(roiX < 0 || roiY < 0 || roiWidth <= 0 || roiHeight <= 0
+                    || roiX + roiWidth > sWidth || roiY + roiHeight > sHeight)
+            {
+                yError() << "The region of interest must be inside the" << sWidth << "x" << sHeight << "sensor";
+                return false;
+            }
+        }
+
+        active = flipx || flipy || roi || spatial > 0 || temporal > 0;
+        if(!active) return true;
+
+        // sensor coordinates, one pixel of border: the neighbours of the edges need no checks
+        stride = sWidth + 2;
+        double never = -std::numeric_limits<double>::infinity();
+        if(spatial > 0) spatialSae.assign(static_cast<size_t>(stride)*(sHeight + 2), never);
+        if(temporal > 0) temporalSae.assign(static_cast<size_t>(stride)*(sHeight + 2), never);
+
+        yInfo() << "Pre-filter: flipx" << flipx << "flipy" << flipy << "| roi" << roiX << roiY << roiWidth << roiHeight
+                << "| spatial" << spatial << "s | temporal" << temporal << "s";
+        return true;
+    }
+
+    bool enabled() const {return active;}
+    unsigned int width() const {return static_cast<unsigned int>(roiWidth);}
+    unsigned int height() const {return static_cast<unsigned int>(roiHeight);}
+
+    /*!
+     * Filter a packet, the result is valid until the next call.
+     */
+    EvSpan apply(const EvSpan &in)
+    {
+        out.resize(in.size());
+        ev::AE *o = out.data();
+
+        for(const ev::AE &e : in)
+        {
+            if(first)
+            {
+                prevTick = e.stamp;
+                first = false;
+            }
+            ts += ev::vtsHelper::deltaS(e.stamp, prevTick);
+            prevTick = e.stamp;
+
+            int x = static_cast<int>(e.x), y = static_cast<int>(e.y);
+            if(x >= sWidth || y >= sHeight) continue;
+            if(flipx) x = sWidth - 1 - x;
+            if(flipy) y = sHeight - 1 - y;
+
+            size_t px = static_cast<size_t>(y + 1)*stride + x + 1;
+            if(spatial > 0)
+            {
+                // every event stamps its pixel, noise included
+                double *s = &spatialSae[px];
+                *s = ts;
+                double last = std::max(std::max(std::max(s[-stride - 1], s[-stride]), std::max(s[-stride + 1], s[-1])),
+                                       std::max(std::max(s[1], s[stride - 1]), std::max(s[stride], s[stride + 1])));
+                if(ts - last > spatial) continue;
+            }
+
+            // crop after the spatial filter stamped the event
+            x -= roiX;
+            y -= roiY;
+            if(x < 0 || y < 0 || x >= roiWidth || y >= roiHeight) continue;
+
+            if(temporal > 0)
+            {
+                // refractory period after the last kept event
+                if(ts - temporalSae[px] < temporal) continue;
+                temporalSae[px] = ts;
+            }
+
+            *o = e;
+            o->x = x;
+            o->y = y;
+            o++;
+        }
+
+        received += in.size();
+        kept += static_cast<size_t>(o - out.data());
+        return EvSpan(out.data(), o);
+    }
+
+    void report() const
+    {
+        if(!active) return;
+        yInfo() << "Pre-filter:" << static_cast<double>(kept) << "of" << static_cast<double>(received) << "events kept";
+    }
+
+private:
+    bool active{false};
+    bool flipx{false}, flipy{false};
+    int sWidth{0}, sHeight{0}; //!< sensor size, before the crop
+    int roiX{0}, roiY{0}, roiWidth{0}, roiHeight{0};
+    double spatial{0.0}; //!< s, 0 disables the spatial filter
+    double temporal{0.0}; //!< s, 0 disables the temporal filter
+
+    int stride{0}; //!< row length of the padded sensor surfaces
+    std::vector<double> spatialSae; //!< last event of each pixel
+    std::vector<double> temporalSae; //!< last kept event of each pixel
+
+    std::vector<ev::AE> out; //!< kept events of the last packet
+    bool first{true};
+    int prevTick{0};
+    double ts{0.0}; //!< time of the filters, in seconds
+
+    size_t received{0}, kept{0};
+};
+
+#endif
+//empty line to make gcc happy
@@ -0,0 +1,130 @@
+/******************************************************************************
+                                                                              *
+ * Copyright (C) 2019 Fondazione Istituto Italiano di Tecnologia (IIT)        *
+ * All Rights Reserved.                                                       *
+                                                                              *
+                                                                              */
+
+/**
+ * @file src/common/renderThread.h
+ * @authors: Leandro de Souza Rosa <leandro.desouzarosa@iit.it>
+ */
+
+#ifndef __RENDER_THREAD_H
+#define __RENDER_THREAD_H
+
+#include <yarp/os/all.h>
+
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <opencv2/core/mat.hpp>
+#include <opencv2/highgui.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include "threadPlacement.h"
+
+/**
+ * @class Render
+ * @brief Displays the latest published snapshot at a fixed fps
+ *
+ * The compute thread only copies its snapshot in a free buffer (publish()),
+ * all the normalisation and display work happens here. Snapshots published
+ * while the previous one is still waiting to be shown are not even copied.
+ *
+ * @file src/common/renderThread.h
+ */
+class Render : public yarp::os::PeriodicThread {
+
+public:
+    ThreadPlacement placement; //!< cpu and priority of this thread
+
+    Render() : PeriodicThread(1.0/30) {}
+
+    void initialise(std::string m_name, unsigned int m_fps, double m_scale)
+    {
+        name = m_name;
+        scale = m_scale;
+        setPeriod(1.0/m_fps);
+    }
+
+    /*!
+     * Hand a snapshot to the render thread. Never waits for the display.
+     */
+    void publish(const cv::Mat &frame)
+    {
+        {
+            // the display has not taken the last frame yet, skip this one
+            std::lock_guard<std::mutex> lock(guard);
+            if(fresh) return;
+        }
+        frame.copyTo(back);
+        std::lock_guard<std::mutex> lock(guard);
+        cv::swap(back, latest);
+        fresh = true;
+    }
+
+    bool threadInit()
+    {
+        placement.apply();
+
+        // all the highgui calls are done from this thread
+        cv::namedWindow(name, cv::WINDOW_NORMAL);
+        cv::resizeWindow(name, 800, 800);
+        cv::waitKey(1);
+        return true;
+    }
+
+    void run()
+    {
+        bool show = false;
+        {
+            std::lock_guard<std::mutex> lock(guard);
+            if(fresh)
+            {
+                cv::swap(latest, front);
+                fresh = false;
+                show = true;
+            }
+        }
+
+        if(show)
+        {
+            if(scale < 1.0)
+                cv::resize(front, small, cv::Size(), scale, scale, cv::INTER_AREA);
+            else
+                small = front;
+
+            // several channels (e.g. a temporal bank) are shown side by side
+            if(small.channels() > 1)
+            {
+                cv::split(small, channels);
+                cv::hconcat(channels, tiled);
+                small = tiled;
+            }
+
+            // 8 bits, inverted colours
+            cv::normalize(small, norm_img, 0, 255, cv::NORM_MINMAX, CV_8U);
+            cv::imshow(name, 255 - norm_img);
+        }
+        cv::waitKey(1);
+    }
+
+    void threadRelease()
+    {
+        cv::destroyWindow(name);
+    }
+
+private:
+    std::string name;
+    double scale{1.0}; //!< downsampling factor applied before display
+    std::mutex guard; //!< protects latest and fresh
+    cv::Mat back, latest, front; //!< written by publish(), last published, being displayed
+    bool fresh{false}; //!< latest has not been displayed yet
+    cv::Mat small, tiled, norm_img;
+    std::vector<cv::Mat> channels;
+};
+
+#endif
+//empty line to make gcc happy
@@ -0,0 +1,263 @@
+/******************************************************************************
+                                                                              *
+ * Copyright (C) 2019 Fondazione Istituto Italiano di Tecnologia (IIT)        *
+ * All Rights Reserved.                                                       *
+                                                                              *
+                                                                              */
+
+/**
+ * @file src/common/shmFrames.h
+ * @authors: Leandro de Souza Rosa <leandro.desouzarosa@iit.it>
+ *
+ * Shared memory ring of snapshots, written by liteConv (--shm <name>) and
+ * read by co-located consumers. Only depends on POSIX, consumers include
+ * this file and map the ring with ShmFrameReader:
+ *
+ *    ShmFrameReader reader;
+ *    reader.open("/liteConv");
+ *    ShmFrameReader::Frame f;
+ *    if(reader.latest(f))
+ *    {
+ *        cv::Mat convolved(reader.rows(), reader.cols(), reader.type(), const_cast<void*>(f.data));
+ *        ... use convolved in place ...
+ *        if(!reader.valid(f)) ... the producer overwrote it meanwhile, discard the result ...
+ *    }
+ *
+ * The producer never waits for the readers: a slot is protected by a
+ * sequence counter (odd while written), readers check it after using a
+ * frame. With n slots a frame stays valid for n-1 snapshots. A restarted
+ * producer creates a new ring, readers still mapped to the previous one keep
+ * it (it never changes size under them) and reopen the name to follow.
+ */
+
+#ifndef __SHM_FRAMES_H
+#define __SHM_FRAMES_H
+
+#include <atomic>
+#include <string>
+#include <cstring>
+#include <cstdint>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define SHM_FRAMES_MAGIC "SHF1"
+#define SHM_FRAMES_ALIGN 4096
+
+struct ShmFramesHeader {
+    char magic[4];                  //!< "SHF1", written last by the producer
+    uint32_t slots;                 //!< number of frames in the ring
+    int32_t rows, cols, type;       //!< frame size and OpenCV type
+    uint64_t frameBytes;            //!< bytes of a frame
+    uint64_t slotStride;            //!< bytes between two slots
+    std::atomic<uint64_t> latest;   //!< number of the last complete frame, 0 if none
+};
+
+struct ShmFrameSlot {
+    std::atomic<uint64_t> seq;      //!< 2*frame while valid, odd while written
+    double ts;                      //!< event time of the snapshot
+};
+
+#define SHM_FRAMES_DATA_OFFSET 64 // frame data offset inside a slot
+
+static_assert(sizeof(ShmFramesHeader) <= SHM_FRAMES_ALIGN, "ShmFramesHeader must fit its page");
+static_assert(sizeof(ShmFrameSlot) <= SHM_FRAMES_DATA_OFFSET, "ShmFrameSlot must fit before the data");
+
+/**
+ * @class ShmFrameWriter
+ * @brief Producer side of the ring, the module writes its snapshots directly in a slot
+ *
+ * @file src/common/shmFrames.h
+ */
+class ShmFrameWriter {
+
+public:
+    ~ShmFrameWriter()
+    {
+        if(base) munmap(base, mapSize);
+        if(!name.empty()) shm_unlink(name.c_str());
+    }
+
+    /*!
+     * Create the ring, replacing the one of a previous run under the same name.
+     *
+     * \return bool true/false iff success/fail.
+     */
+    bool open(const std::string &m_name, int rows, int cols, int type, size_t elemSize, unsigned int slots)
+    {
+        if(slots < 2) return false;
+
+        uint64_t frameBytes = static_cast<uint64_t>(rows)*cols*elemSize;
+        uint64_t stride = (SHM_FRAMES_DATA_OFFSET + frameBytes + SHM_FRAMES_ALIGN - 1)/SHM_FRAMES_ALIGN*SHM_FRAMES_ALIGN;
+        mapSize = SHM_FRAMES_ALIGN + slots*stride;
+
+        // a new object: a reader of the previous ring is not truncated under its feet
+        shm_unlink(m_name.c_str());
+        int fd = shm_open(m_name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+        if(fd < 0) return false;
+        name = m_name;
+        if(ftruncate(fd, mapSize) != 0)
+        {
+            close(fd);
+            return false;
+        }
+        base = mmap(nullptr, mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if(base == MAP_FAILED)
+        {
+            base = nullptr;
+            return false;
+        }
+
+        header = static_cast<ShmFramesHeader*>(base);
+        std::memset(header->magic, 0, 4);
+        header->slots = slots;
+        header->rows = rows;
+        header->cols = cols;
+        header->type = type;
+        header->frameBytes = frameBytes;
+        header->slotStride = stride;
+        header->latest.store(0, std::memory_order_relaxed);
+        for(unsigned int i = 0; i < slots; i++)
+            slot(i)->seq.store(0, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        std::memcpy(header->magic, SHM_FRAMES_MAGIC, 4);
+        return true;
+    }
+
+    /*!
+     * Claim the slot of the next frame.
+     *
+     * \return pointer to write the frame to.
+     */
+    void* begin()
+    {
+        ShmFrameSlot *s = slot(frame % header->slots);
+        s->seq.store(2*frame + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        return reinterpret_cast<char*>(s) + SHM_FRAMES_DATA_OFFSET;
+    }
+
+    /*!
+     * Publish the frame written after begin().
+     */
+    void commit(double ts)
+    {
+        ShmFrameSlot *s = slot(frame % header->slots);
+        s->ts = ts;
+        frame++;
+        s->seq.store(2*frame, std::memory_order_release);
+        header->latest.store(frame, std::memory_order_release);
+    }
+
+private:
+    ShmFrameSlot* slot(uint64_t i)
+    {
+        return reinterpret_cast<ShmFrameSlot*>(static_cast<char*>(base) + SHM_FRAMES_ALIGN + i*header->slotStride);
+    }
+
+    std::string name;
+    void *base{nullptr};
+    size_t mapSize{0};
+    ShmFramesHeader *header{nullptr};
+    uint64_t frame{0}; //!< frames published so far
+};
+
+/**
+ * @class ShmFrameReader
+ * @brief Consumer side of the ring, no copies and no syscalls after open()
+ *
+ * @file src/common/shmFrames.h
+ */
+class ShmFrameReader {
+
+public:
+    struct Frame {
+        const void *data;   //!< frame in shared memory
+        uint64_t number;    //!< frame number, increasing
+        double ts;          //!< event time of the snapshot
+        uint64_t seq;       //!< slot sequence when the frame was taken
+        const ShmFrameSlot *slot;
+    };
+
+    ~ShmFrameReader()
+    {
+        if(base) munmap(base, mapSize);
+    }
+
+    /*!
+     * Map an existing ring, read only.
+     *
+     * \return bool true/false iff success/fail.
+     */
+    bool open(const std::string &name)
+    {
+        int fd = shm_open(name.c_str(), O_RDONLY, 0);
+        if(fd < 0) return false;
+        struct stat st;
+        if(fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < SHM_FRAMES_ALIGN)
+        {
+            close(fd);
+            return false;
+        }
+        mapSize = static_cast<size_t>(st.st_size);
+        base = mmap(nullptr, mapSize, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if(base == MAP_FAILED)
+        {
+            base = nullptr;
+            return false;
+        }
+        header = static_cast<const ShmFramesHeader*>(base);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return std::strncmp(header->magic, SHM_FRAMES_MAGIC, 4) == 0
+                && SHM_FRAMES_ALIGN + header->slots*header->slotStride <= mapSize;
+    }
+
+    /*!
+     * The most recent complete frame, in place.
+     *
+     * \return bool false if no frame was published yet.
+     */
+    bool latest(Frame &f) const
+    {
+        uint64_t n = header->latest.load(std::memory_order_acquire);
+        if(n == 0) return false;
+        const ShmFrameSlot *s = slot((n - 1) % header->slots);
+        uint64_t seq = s->seq.load(std::memory_order_acquire);
+        if(seq != 2*n) return false; // already being overwritten
+        f = Frame{reinterpret_cast<const char*>(s) + SHM_FRAMES_DATA_OFFSET, n, s->ts, seq, s};
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if(s->seq.load(std::memory_order_relaxed) != seq) return false;
+        return true;
+    }
+
+    /*!
+     * True if the frame was not overwritten since latest() returned it.
+     */
+    bool valid(const Frame &f) const
+    {
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return f.slot->seq.load(std::memory_order_relaxed) == f.seq;
+    }
+
+    int rows() const {return header->rows;}
+    int cols() const {return header->cols;}
+    int type() const {return header->type;}
+    size_t frameBytes() const {return header->frameBytes;}
+
+private:
+    const ShmFrameSlot* slot(uint64_t i) const
+    {
+        return reinterpret_cast<const ShmFrameSlot*>(static_cast<const char*>(base) + SHM_FRAMES_ALIGN + i*header->slotStride);
+    }
+
+    void *base{nullptr};
+    size_t mapSize{0};
+    const ShmFramesHeader *header{nullptr};
+};
+
+#endif
+//empty line to make gcc happy
@@ -0,0 +1,329 @@
+/******************************************************************************
+                                                                              *
+ * Copyright (C) 2019 Fondazione Istituto Italiano di Tecnologia (IIT)        *
+ * All Rights Reserved.                                                       *
+                                                                              *
+                                                                              */
+
+/**
+ * @file src/common/snapshotScheduler.h
+ * @authors: Leandro de Souza Rosa <leandro.desouzarosa@iit.it>
+ */
+
+#ifndef __SNAPSHOT_SCHEDULER_H
+#define __SNAPSHOT_SCHEDULER_H
+
+#include <yarp/os/all.h>
+
+#include <mutex>
+#include <chrono>
+#include <string>
+#include <sstream>
+#include <cstdint>
+#include <algorithm> // std max
+#include <condition_variable>
+
+/**
+ * @class SnapshotScheduler
+ * @brief Decides when the snapshot thread runs
+ *
+ * Policies (--snapshot):
+ *    - asap: after every packet of events (default)
+ *    - period: every --snapshotPeriod seconds, if events arrived meanwhile
+ *    - events: every --snapshotEvents events
+ *    - demand: on request of a consumer (rpc "snapshot")
+ *    - latency: the first event not in a snapshot waits at most --snapshotLatency seconds
+ *
+ * At most one snapshot is pending: triggers arriving while a snapshot is
+ * pending are collapsed into it, so a busy snapshot thread skips snapshots
+ * instead of queueing them. The snapshot thread sleeps between snapshots.
+ *
+ * @file src/common/snapshotScheduler.h
+ */
+class SnapshotScheduler {
+
+public:
+    enum Policy {ASAP, PERIOD, EVENTS, DEMAND, LATENCY};
+
+    /*!
+     * Read the policy from the command line.
+     *
+     * \return bool true/false iff success/fail.
+     */
+    bool configure(yarp::os::ResourceFinder &rf)
+    {
+        std::string name = rf.check("snapshot", yarp::os::Value("asap")).asString();
+        period = rf.check("snapshotPeriod", yarp::os::Value(1.0/30)).asFloat64();
+        int events = rf.check("snapshotEvents", yarp::os::Value(1000)).asInt32();
+        latency = rf.check("snapshotLatency", yarp::os::Value(0.01)).asFloat64();
+
+        if(name == "asap") policy = ASAP;
+        else if(name == "period") policy = PERIOD;
+        else if(name == "events") policy = EVENTS;
+        else if(name == "demand") policy = DEMAND;
+        else if(name == "latency") policy = LATENCY;
+        else
+        {
+            yError() << "Unknown snapshot policy" << name << "(asap, period, events, demand, latency)";
+            return false;
+        }
+        if(period <= 0 || latency <= 0 || events <= 0)
+        {
+            yError() << "snapshotPeriod, snapshotLatency and snapshotEvents must be positive";
+            return false;
+        }
+        nEvents = static_cast<unsigned int>(events);
+        label = name;
+        return true;
+    }
+
+    /*!
+     * Event thread: n events were added to the surfaces.
+     */
+    void events(size_t n)
+    {
+        if(!n) return;
+        Clock::time_point now = Clock::now();
+        std::lock_guard<std::mutex> lock(guard);
+        if(!pending)
+        {
+            firstPending = now;
+            if(!begun)
+            {
+                begun = true;
+                firstEvent = now;
+            }
+        }
+        pending += n;
+
+        if(policy == ASAP)
+            trigger();
+        else if(policy == EVENTS)
+        {
+            counted += n;
+            if(counted >= nEvents)
+            {
+                collapsed += counted/nEvents - 1;
+                counted %= nEvents;
+                trigger();
+            }
+        }
+        else if(policy == PERIOD || policy == LATENCY)
+            wake.notify_one(); // the snapshot thread arms its timer
+    }
+
+    /*!
+     * Consumer: ask for a snapshot and wait until one started after the
+     * request is complete.
+     *
+     * \param ts event time the published snapshot was decayed to
+     * \return bool false on timeout or stop.
+     */
+    bool request(double timeout, double &ts)
+    {
+        std::unique_lock<std::mutex> lock(guard);
+        uint64_t target = started + 1;
+        trigger();
+        if(!done.wait_for(lock, std::chrono::duration<double>(timeout),
+                          [&]{return stopping || completed >= target;}) || stopping)
+            return false;
+        ts = lastTs;
+        return true;
+    }
+
+    /*!
+     * Snapshot thread: sleep until the next snapshot is due.
+     *
+     * \return bool false when stopping.
+     */
+    bool wait()
+    {
+        std::unique_lock<std::mutex> lock(guard);
+        while(!stopping && !due)
+        {
+            if(pending && (policy == PERIOD || policy == LATENCY))
+            {
+                Clock::time_point at = deadline();
+                if(Clock::now() >= at)
+                    break;
+                wake.wait_until(lock, at);
+            }
+            else
+                wake.wait(lock);
+        }
+        if(stopping) return false;
+
+        // a demand snapshot does not shift the fixed period
+        bool timer = !due;
+        due = false;
+        started++;
+        covered = pending ? firstPending : Clock::time_point();
+        coversEvents = pending > 0;
+        pending = 0;
+        begin = Clock::now();
+        if(policy == PERIOD && timer)
+            nextTick += toDuration(period);
+        return true;
+    }
+
+    /*!
+     * Snapshot thread: the snapshot started by wait(), decayed to the event
+     * time ts, is published.
+     */
+    void finish(double ts)
+    {
+        Clock::time_point now = Clock::now();
+        std::lock_guard<std::mutex> lock(guard);
+        completed++;
+        lastTs = ts;
+
+        double compute = seconds(now - begin);
+        computeSum += compute;
+        computeAvg = completed == 1 ? compute : 0.9*computeAvg + 0.1*compute;
+        if(coversEvents)
+        {
+            double staleness = seconds(now - covered);
+            stalenessSum += staleness;
+            stalenessMax = std::max(stalenessMax, staleness);
+            withEvents++;
+            if(policy == LATENCY && staleness > latency) late++;
+        }
+        last = now;
+
+        // ticks that went by while computing are skipped
+        if(policy == PERIOD)
+        {
+            while(nextTick < now)
+            {
+                nextTick += toDuration(period);
+                collapsed++;
+            }
+        }
+        done.notify_all();
+    }
+
+    /*!
+     * Wake up and release the snapshot thread and the consumers.
+     */
+    void stop()
+    {
+        std::lock_guard<std::mutex> lock(guard);
+        stopping = true;
+        wake.notify_all();
+        done.notify_all();
+    }
+
+    std::string stats()
+    {
+        std::lock_guard<std::mutex> lock(guard);
+        double elapsed = begun ? seconds(last - firstEvent) : 0.0;
+        std::ostringstream s;
+        s << label << ": " << completed << " snapshots, "
+          << (elapsed > 0 ? completed/elapsed : 0.0) << " Hz, "
+          << collapsed << " collapsed triggers, compute "
+          << (completed ? 1e3*computeSum/completed : 0.0) << " ms, staleness mean "
+          << (withEvents ? 1e3*stalenessSum/withEvents : 0.0) << " ms max "
+          << 1e3*stalenessMax << " ms";
+        if(policy == LATENCY)
+            s << ", " << late << " over the " << 1e3*latency << " ms target";
+        return s.str();
+    }
+
+    void report()
+    {
+        yInfo() << "snapshot scheduler" << stats();
+    }
+
+    /*!
+     * Rpc commands of the modules: "snapshot" requests a snapshot and replies
+     * once it is published, with its event time, "stats" replies stats().
+     *
+     * \return bool true iff the command was handled.
+     */
+    bool respond(const yarp::os::Bottle& command, yarp::os::Bottle& reply)
+    {
+        std::string cmd = command.get(0).asString();
+        if(cmd == "snapshot")
+        {
+            // replies once a snapshot covering the events received so far is published
+            double ts;
+            if(request(1.0, ts))
+            {
+                reply.addString("ok");
+                reply.addFloat64(ts);
+            }
+            else
+                reply.addString("timeout");
+            return true;
+        }
+        if(cmd == "stats")
+        {
+            reply.addString(stats());
+            return true;
+        }
+        return false;
+    }
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    static Clock::duration toDuration(double s)
+    {
+        return std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(s));
+    }
+
+    static double seconds(Clock::duration d)
+    {
+        return std::chrono::duration<double>(d).count();
+    }
+
+    // called with the lock held
+    void trigger()
+    {
+        if(due)
+            collapsed++;
+        due = true;
+        wake.notify_one();
+    }
+
+    // time based policies, called with the lock held and events pending
+    Clock::time_point deadline()
+    {
+        if(policy == PERIOD)
+        {
+            // after an idle time, restart the ticks from the first new event
+            if(nextTick < firstPending)
+                nextTick = firstPending;
+            return nextTick;
+        }
+        // leave the expected compute time to reach the target
+        return firstPending + toDuration(std::max(0.0, latency - computeAvg));
+    }
+
+    Policy policy{ASAP};
+    std::string label{"asap"};
+    double period{1.0/30}; //!< s, PERIOD
+    unsigned int nEvents{1000}; //!< EVENTS
+    double latency{0.01}; //!< s, LATENCY
+
+    std::mutex guard;
+    std::condition_variable wake; //!< snapshot thread
+    std::condition_variable done; //!< consumers waiting for a snapshot
+    bool stopping{false};
+    bool due{false}; //!< a snapshot is pending
+    size_t pending{0}; //!< events not in any snapshot yet
+    size_t counted{0}; //!< events towards the next EVENTS trigger
+    Clock::time_point firstPending; //!< arrival of the first pending event
+    Clock::time_point nextTick; //!< next PERIOD snapshot
+
+    // statistics
+    bool begun{false};
+    Clock::time_point firstEvent, begin, last, covered;
+    bool coversEvents{false};
+    double lastTs{0.0}; //!< event time of the last published snapshot
+    uint64_t started{0}, completed{0}, collapsed{0}, withEvents{0}, late{0};
+    double computeSum{0.0}, computeAvg{0.0}, stalenessSum{0.0}, stalenessMax{0.0};
+};
+
+#endif
+//empty line to make gcc happy
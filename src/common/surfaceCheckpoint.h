@@ -0,0 +1,258 @@
+/******************************************************************************
+                                                                              *
+ * Copyright (C) 2019 Fondazione Istituto Italiano di Tecnologia (IIT)        *
+ * All Rights Reserved.                                                       *
+                                                                              *
+                                                                              */
+
+/**
+ * @file src/common/surfaceCheckpoint.h
+ * @authors: Leandro de Souza Rosa <leandro.desouzarosa@iit.it>
+ */
+
+#ifndef __SURFACE_CHECKPOINT_H
+#define __SURFACE_CHECKPOINT_H
+
+#include <yarp/os/all.h>
+
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cstdint>
+#include <cerrno>
+#include <algorithm> // std max
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <opencv2/core/mat.hpp>
+
+#define CHECKPOINT_MAGIC "SCK2"
+#define CHECKPOINT_MAX_PLANES 4
+#define CHECKPOINT_SLOTS 2 // copies alternate, a crash during one leaves the other
+#define CHECKPOINT_HEADER_SIZE 4096 // one page, the planes start page aligned
+
+struct CheckpointSlot {
+    uint64_t seq;           //!< 2*n once the n-th copy is complete, odd while it is written, 0 if never written
+    double lastTs;          //!< event time of the copy (module last_ts)
+    double wallTime;        //!< wall clock time of the copy
+};
+
+struct CheckpointHeader {
+    char magic[4];          //!< "SCK2"
+    uint32_t nPlanes;       //!< number of surfaces
+    CheckpointSlot slots[CHECKPOINT_SLOTS];
+    struct {
+        int32_t rows, cols, type, reserved;
+    } planes[CHECKPOINT_MAX_PLANES];
+};
+static_assert(sizeof(CheckpointHeader) <= CHECKPOINT_HEADER_SIZE, "CheckpointHeader must fit its page");
+
+/**
+ * @class SurfaceCheckpoint
+ * @brief Periodically copies the module surfaces to a memory mapped file
+ *
+ * The copy runs on its own thread and never locks the surfaces: the event
+ * thread keeps writing while a checkpoint is taken, so a checkpoint mixes
+ * pixels from a few ms apart, which is harmless for a warm restart. The
+ * event time of a copy is read after it, so no stored pixel is newer. The
+ * copies alternate between two slots, each with a sequence counter: a copy
+ * interrupted by a crash leaves the previous one to restore.
+ *
+ * @file src/common/surfaceCheckpoint.h
+ */
+class SurfaceCheckpoint : public yarp::os::PeriodicThread {
+
+public:
+    SurfaceCheckpoint() : PeriodicThread(1.0) {}
+
+    ~SurfaceCheckpoint()
+    {
+        if(base) munmap(base, mapSize);
+        if(fd >= 0) close(fd);
+    }
+
+    /*!
+     * Map (creating it if needed) the checkpoint file for the given surfaces.
+     *
+     * \return bool true/false iff success/fail.
+     */
+    bool initialise(const std::string &path, const std::vector<cv::Mat> &m_planes, double *last_ts, double period)
+    {
+        planes = m_planes;
+        img_ts = last_ts;
+        if(period <= 0)
+        {
+            yError() << "checkpointPeriod must be positive";
+            return false;
+        }
+        setPeriod(period);
+
+        if(planes.size() > CHECKPOINT_MAX_PLANES)
+        {
+            yError() << "At most" << CHECKPOINT_MAX_PLANES << "surfaces can be checkpointed";
+            return false;
+        }
+
+        slotSize = 0;
+        for(auto &p : planes)
+        {
+            if(!p.isContinuous())
+            {
+                yError() << "Checkpointed surfaces must be continuous";
+                return false;
+            }
+            slotSize += p.total()*p.elemSize();
+        }
+        mapSize = CHECKPOINT_HEADER_SIZE + CHECKPOINT_SLOTS*slotSize;
+
+        fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+        if(fd < 0)
+        {
+            yError() << "Could not open the checkpoint" << path << "-" << std::strerror(errno);
+            return false;
+        }
+
+        struct stat st;
+        bool existing = fstat(fd, &st) == 0 && static_cast<size_t>(st.st_size) == mapSize;
+        if(!existing && ftruncate(fd, mapSize) != 0)
+        {
+            yError() << "Could not resize the checkpoint" << path << "-" << std::strerror(errno);
+            return false;
+        }
+
+        base = mmap(nullptr, mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if(base == MAP_FAILED)
+        {
+            base = nullptr;
+            yError() << "Could not map the checkpoint" << path;
+            return false;
+        }
+        header = static_cast<CheckpointHeader*>(base);
+
+        restorable = existing && matches();
+        if(!restorable)
+        {
+            // new file or different surfaces: start a fresh checkpoint
+            std::memset(header, 0, sizeof(CheckpointHeader));
+            std::memcpy(header->magic, CHECKPOINT_MAGIC, 4);
+            header->nPlanes = static_cast<uint32_t>(planes.size());
+            for(size_t i = 0; i < planes.size(); i++)
+            {
+                header->planes[i].rows = planes[i].rows;
+                header->planes[i].cols = planes[i].cols;
+                header->planes[i].type = planes[i].type();
+            }
+        }
+
+        // continue after the newest complete copy, the next copy overwrites
+        // the other slot (older or interrupted)
+        for(int i = 0; i < CHECKPOINT_SLOTS; i++)
+            copies = std::max(copies, header->slots[i].seq/2);
+        return true;
+    }
+
+    /*!
+     * Copy the last complete checkpoint back into the surfaces.
+     *
+     * \param ts event time (last_ts) the surfaces refer to
+     * \param wallTime wall clock time the checkpoint was taken at, the
+     *        downtime runs until the first new event
+     * \return bool true iff a valid checkpoint was restored.
+     */
+    bool restore(double &ts, double &wallTime)
+    {
+        if(!restorable)
+            return false;
+
+        // the newest complete copy
+        int newest = -1;
+        for(int i = 0; i < CHECKPOINT_SLOTS; i++)
+        {
+            uint64_t seq = header->slots[i].seq;
+            if(seq && seq % 2 == 0 && (newest < 0 || seq > header->slots[newest].seq))
+                newest = i;
+        }
+        if(newest < 0)
+            return false;
+
+        const char *src = slotData(newest);
+        for(auto &p : planes)
+        {
+            size_t bytes = p.total()*p.elemSize();
+            std::memcpy(p.data, src, bytes);
+            src += bytes;
+        }
+        ts = header->slots[newest].lastTs;
+        wallTime = header->slots[newest].wallTime;
+        return true;
+    }
+
+    void run()
+    {
+        // the slot of the oldest copy, the newest one stays intact meanwhile
+        copies++;
+        CheckpointSlot &slot = header->slots[copies % CHECKPOINT_SLOTS];
+
+        // odd: copy in progress
+        slot.seq = 2*copies - 1;
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+
+        char *dst = slotData(copies % CHECKPOINT_SLOTS);
+        for(auto &p : planes)
+        {
+            size_t bytes = p.total()*p.elemSize();
+            std::memcpy(dst, p.data, bytes);
+            dst += bytes;
+        }
+        // after the copy: the event thread kept stamping the SAE meanwhile
+        slot.lastTs = *img_ts;
+        slot.wallTime = yarp::os::Time::now();
+
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        slot.seq = 2*copies;
+
+        // let the kernel write back in the background
+        msync(base, mapSize, MS_ASYNC);
+    }
+
+    void threadRelease()
+    {
+        // last checkpoint on a clean shutdown
+        run();
+    }
+
+private:
+    char* slotData(int slot) const
+    {
+        return static_cast<char*>(base) + CHECKPOINT_HEADER_SIZE + slot*slotSize;
+    }
+
+    bool matches() const
+    {
+        if(std::strncmp(header->magic, CHECKPOINT_MAGIC, 4) != 0 || header->nPlanes != planes.size())
+            return false;
+        for(size_t i = 0; i < planes.size(); i++)
+        {
+            if(header->planes[i].rows != planes[i].rows || header->planes[i].cols != planes[i].cols
+                    || header->planes[i].type != planes[i].type())
+                return false;
+        }
+        return true;
+    }
+
+    std::vector<cv::Mat> planes; //!< headers of the module surfaces
+    double *img_ts{nullptr}; //!< module last_ts
+    int fd{-1};
+    void *base{nullptr};
+    size_t mapSize{0};
+    size_t slotSize{0}; //!< bytes of a copy of all the surfaces
+    uint64_t copies{0}; //!< copies taken, including those of previous runs
+    CheckpointHeader *header{nullptr};
+    bool restorable{false};
+};
+
+#endif
+//empty line to make gcc happy
@@ -0,0 +1,136 @@
+/******************************************************************************
+                                                                              *
+ * Copyright (C) 2019 Fondazione Istituto Italiano di Tecnologia (IIT)        *
+ * All Rights Reserved.                                                       *
+                                                                              *
+                                                                              */
+
+/**
+ * @file src/common/threadPlacement.h
+ * @authors: Leandro de Souza Rosa <leandro.desouzarosa@iit.it>
+ */
+
+#ifndef __THREAD_PLACEMENT_H
+#define __THREAD_PLACEMENT_H
+
+#include <yarp/os/all.h>
+
+#include <string>
+#include <cstring>
+#include <cerrno>
+
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+
+/**
+ * @class ThreadPlacement
+ * @brief CPU affinity and real-time priority of a module thread
+ *
+ * Read from <prefix>Cpu and <prefix>Priority, and applied by the thread itself
+ * when it starts. A cpu of -1 leaves the thread to the OS, a priority of 0
+ * keeps the default SCHED_OTHER policy.
+ *
+ * @file src/common/threadPlacement.h
+ */
+class ThreadPlacement {
+
+public:
+    std::string label; //!< name used in the report
+    int cpu{-1}; //!< core the thread is pinned to
+    int priority{0}; //!< SCHED_FIFO priority
+
+    void configure(yarp::os::ResourceFinder &rf, const std::string &prefix)
+    {
+        label = prefix;
+        cpu = rf.check(prefix + "Cpu", yarp::os::Value(-1)).asInt32();
+        priority = rf.check(prefix + "Priority", yarp::os::Value(0)).asInt32();
+    }
+
+    /*!
+     * Pin and schedule the calling thread, then report where it ended up.
+     *
+     * \return bool true/false iff the requested placement was applied.
+     */
+    bool apply() const
+    {
+        bool ok = true;
+        pthread_t self = pthread_self();
+
+        if(cpu >= 0)
+        {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(cpu, &set);
+            int err = pthread_setaffinity_np(self, sizeof(set), &set);
+            if(err)
+            {
+                yWarning() << label << ": could not pin to cpu" << cpu << "-" << std::strerror(err);
+                ok = false;
+            }
+        }
+
+        if(priority > 0)
+        {
+            sched_param param;
+            param.sched_priority = priority;
+            int err = pthread_setschedparam(self, SCHED_FIFO, &param);
+            if(err)
+            {
+                // EPERM without CAP_SYS_NICE or an rtprio limit
+                yWarning() << label << ": could not set SCHED_FIFO priority" << priority << "-" << std::strerror(err);
+                ok = false;
+            }
+        }
+
+        report();
+        return ok;
+    }
+
+    /*!
+     * Log the placement actually in effect for the calling thread.
+     */
+    void report() const
+    {
+        int policy;
+        sched_param param;
+        pthread_getschedparam(pthread_self(), &policy, &param);
+
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        pthread_getaffinity_np(pthread_self(), sizeof(set), &set);
+        std::string cpus;
+        for(int i = 0; i < CPU_SETSIZE; i++)
+            if(CPU_ISSET(i, &set)) cpus += (cpus.empty() ? "" : ",") + std::to_string(i);
+
+        yInfo() << label << "thread: running on cpu" << sched_getcpu() << "allowed {" << cpus << "}"
+                << (policy == SCHED_FIFO ? "SCHED_FIFO" : policy == SCHED_RR ? "SCHED_RR" : "SCHED_OTHER")
+                << "priority" << param.sched_priority;
+    }
+};
+
+#ifndef MCL_ONFAULT
+    #define MCL_ONFAULT 4 // Linux 4.4, missing from older C libraries
+#endif
+
+/*!
+ * Lock current and future pages of the process in RAM, so the surfaces
+ * (already touched by their initialisation) never page fault in the hot loops.
+ * Pages are locked as they are touched (MCL_ONFAULT): mappings that are not
+ * hot state, e.g. an EVB file, are not read in and can be unlocked after.
+ *
+ * \return bool true/false iff success/fail.
+ */
+inline bool lockMemory()
+{
+    if(mlockall(MCL_CURRENT | MCL_FUTURE | MCL_ONFAULT) != 0)
+    {
+        yWarning() << "Could not lock the process memory -" << std::strerror(errno);
+        return false;
+    }
+    yInfo() << "Process memory locked";
+    return true;
+}
+
+#endif
+//empty line to make gcc happy
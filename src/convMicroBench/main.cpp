@@ -0,0 +1,361 @@
+/******************************************************************************
+                                                                              *
+ * Copyright (C) 2019 Fondazione Istituto Italiano di Tecnologia (IIT)        *
+ * All Rights Reserved.                                                       *
+                                                                              *
+                                                                              */
+
+/**
+ * @file src/convMicroBench/main.cpp
+ * @authors: Leandro de Souza Rosa <leandro.desouzarosa@iit.it>
+ *
+ * Microbenchmarks of the building blocks of liteConv and refConv, the kernels
+ * of src/common/convKernels.h the modules run:
+ *    - liteUpdate: single pixel event update of LiteConv::run() (planar and interleaved)
+ *    - refPatch: kSize x kSize patch update of RefConv::run() (planar and interleaved)
+ *    - refBatch: RefConv::run() with --batch, gather, one exp per block of events, apply
+ *    - frameDecay: full frame decay of the snapshot threads (dt, exp, mul)
+ *    - filter2D: full frame convolution of UpdateAndConvolve::run()
+ * swept over resolution, kSize, precision and number of threads.
+ *
+ * Results are written as CSV (one row per configuration) to compare commits and hosts:
+ *    host,cpu,label,primitive,width,height,ksize,precision,threads,ops,median_ns,min_ns
+ * times are per event (liteUpdate, refPatch, refBatch) or per frame (frameDecay, filter2D).
+ * refBatch is also compared bit for bit with refPatch, the result goes to stderr.
+ *
+ * usage: convMicroBench [--label <commit>] [--runs <n>] [--events <n>] [--maxThreads <n>]
+ */
+
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+
+#include <vector>
+#include <string>
+#include <random>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+#include <functional>
+
+#define _USE_MATH_DEFINES
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+
+#include <unistd.h>
+
+#include "convKernels.h"
+
+struct Event {
+    int x, y;
+    bool polarity;
+    double ts;
+};
+
+struct Resolution {
+    int width, height;
+};
+
+static const std::vector<Resolution> resolutions = {{346, 260}, {640, 480}, {1280, 720}};
+static const std::vector<int> kSizes = {3, 5, 7, 9, 15};
+static const std::vector<int> depths = {CV_32F, CV_64F};
+static const double alpha = M_PI;
+static const int batch = 64; //!< events per block of refBatch
+
+// keeps the compiler from removing the benchmarked code
+static double sink = 0.0;
+
+static std::string cpuName()
+{
+    std::ifstream cpuinfo("/proc/cpuinfo");
+    std::string line;
+    while(std::getline(cpuinfo, line))
+    {
+        if(line.compare(0, 10, "model name") == 0)
+        {
+            std::string name = line.substr(line.find(':') + 2);
+            std::replace(name.begin(), name.end(), ',', ' ');
+            return name;
+        }
+    }
+    return "unknown";
+}
+
+static std::vector<Event> makeEvents(const Resolution &r, size_t n)
+{
+    // fixed seed, the same events on every host
+    std::mt19937 gen(42);
+    std::uniform_int_distribution<int> x(0, r.width - 1), y(0, r.height - 1), p(0, 1);
+    std::vector<Event> events(n);
+    double ts = 0.0;
+    for(auto &e : events)
+    {
+        ts += 1e-6;
+        e = {x(gen), y(gen), p(gen) == 1, ts};
+    }
+    return events;
+}
+
+/*
+ * Median and min time of `runs` calls of f, each covering `ops` operations, in ns per operation.
+ */
+static void measure(int runs, size_t ops, const std::function<void()> &f, double &median, double &best)
+{
+    f(); // warm up caches and lazy allocations
+    std::vector<double> times;
+    for(int i = 0; i < runs; i++)
+    {
+        auto tic = std::chrono::steady_clock::now();
+        f();
+        auto toc = std::chrono::steady_clock::now();
+        times.push_back(std::chrono::duration<double, std::nano>(toc - tic).count()/ops);
+    }
+    std::sort(times.begin(), times.end());
+    median = times[times.size()/2];
+    best = times.front();
+}
+
+/*
+ * LiteConv::run(), one pixel per event
+ */
+template<typename T>
+static void liteUpdate(cv::Mat &sae, cv::Mat &img, const std::vector<Event> &events)
+{
+    const T a = static_cast<T>(alpha);
+    for(auto &e : events)
+        litePixel<T>(sae.at<T>(e.y, e.x), &img.at<T>(e.y, e.x), &a, 1, e, static_cast<T>(e.ts));
+}
+
+/*
+ * LiteConv::run() with INTERLEAVED, (sae, img) side by side
+ */
+template<typename T>
+static void liteUpdateInterleaved(cv::Mat &state, const std::vector<Event> &events)
+{
+    const T a = static_cast<T>(alpha);
+    for(auto &e : events)
+    {
+        cv::Vec<T, 2> &px = state.at<cv::Vec<T, 2>>(e.y, e.x);
+        litePixel<T>(px[0], &px[1], &a, 1, e, static_cast<T>(e.ts));
+    }
+}
+
+/*
+ * RefConv::run(), kSize x kSize patch per event on padded surfaces
+ */
+static void refPatch(cv::Mat &sae, cv::Mat &img, const cv::Mat &kernel, const std::vector<Event> &events,
+                     cv::Mat &coefs, cv::Mat &decay)
+{
+    for(auto &e : events)
+    {
+        refPatchCoefs(sae, e, kernel.rows, alpha, e.ts, coefs);
+        cv::exp(coefs, decay);
+        refPatchApply(img, kernel, e, decay);
+    }
+}
+
+/*
+ * RefConv::run() with INTERLEAVED, (sae, img) side by side
+ */
+template<typename T>
+static void refPatchInterleaved(cv::Mat &state, const cv::Mat &kernel, const std::vector<Event> &events,
+                                cv::Mat &scratch, cv::Mat &coefs, cv::Mat &decay)
+{
+    for(auto &e : events)
+    {
+        refPatchCoefsInterleaved<T>(state, e, kernel.rows, alpha, e.ts, scratch, coefs);
+        cv::exp(coefs, decay);
+        refPatchApplyInterleaved<T>(state, kernel, e, decay);
+    }
+}
+
+/*
+ * RefConv::run() with --batch, the decays of a block of events in one exp
+ */
+static void refBatch(cv::Mat &sae, cv::Mat &img, const cv::Mat &kernel, const std::vector<Event> &events,
+                     cv::Mat &batchCoefs, cv::Mat &batchDecay)
+{
+    int k = kernel.rows;
+    for(size_t b = 0; b < events.size(); b += batch)
+    {
+        int n = static_cast<int>(std::min<size_t>(batch, events.size() - b));
+        for(int i = 0; i < n; i++)
+        {
+            cv::Mat rowCoefs = batchCoefs.row(i).reshape(1, k);
+            refPatchCoefs(sae, events[b + i], k, alpha, events[b + i].ts, rowCoefs);
+        }
+        refBlockDecays(batchCoefs, batchDecay, n);
+        for(int i = 0; i < n; i++)
+            refPatchApply(img, kernel, events[b + i], batchDecay.row(i).reshape(1, k));
+    }
+}
+
+/*
+ * Run refPatch and refBatch from the same (empty) surfaces and compare them
+ * bit for bit. cv::exp takes a scalar path for short inputs and a SIMD one
+ * for long inputs, so a kSize x kSize patch and a block of patches may round
+ * differently.
+ *
+ * \return bool true iff the surfaces are identical.
+ */
+static bool checkBatch(const Resolution &r, const cv::Mat &kernel, int depth, const std::vector<Event> &events)
+{
+    int k = kernel.rows, pad = (k - 1)/2;
+    cv::Mat sae[2], img[2];
+    for(int i = 0; i < 2; i++)
+    {
+        sae[i] = cv::Mat::zeros(r.height + 2*pad, r.width + 2*pad, depth);
+        img[i] = cv::Mat::zeros(r.height + 2*pad, r.width + 2*pad, depth);
+    }
+    cv::Mat coefs(k, k, depth), decay(k, k, depth);
+    cv::Mat batchCoefs(batch, k*k, depth), batchDecay(batch, k*k, depth);
+    refPatch(sae[0], img[0], kernel, events, coefs, decay);
+    refBatch(sae[1], img[1], kernel, events, batchCoefs, batchDecay);
+
+    size_t bytes = img[0].total()*img[0].elemSize();
+    bool identical = std::memcmp(sae[0].data, sae[1].data, bytes) == 0
+                  && std::memcmp(img[0].data, img[1].data, bytes) == 0;
+    std::cerr << "refBatch " << r.width << "x" << r.height << " ksize " << k << " "
+              << (depth == CV_32F ? "32F" : "64F");
+    if(identical)
+        std::cerr << ": identical to refPatch" << std::endl;
+    else
+        std::cerr << ": differs from refPatch by up to " << cv::norm(img[0], img[1], cv::NORM_INF) << std::endl;
+    return identical;
+}
+
+/*
+ * Snapshot threads, decay of the whole frame to the last timestamp
+ */
+static void frameDecay(const cv::Mat &sae, const cv::Mat &img, double ts, cv::Mat &dt,
+                       std::vector<cv::Mat> &planes, cv::Mat &decays, cv::Mat &updated)
+{
+    frameDt(sae, ts, dt);
+    frameDecays(dt, &alpha, 1, planes, decays);
+    updated = img.mul(decays);
+}
+
+int main(int argc, char * argv[])
+{
+    std::string label = "none";
+    int runs = 7;
+    size_t nEvents = 100000;
+    int maxThreads = cv::getNumberOfCPUs();
+
+    for(int i = 1; i + 1 < argc; i += 2)
+    {
+        std::string arg = argv[i];
+        if(arg == "--label") label = argv[i+1];
+        else if(arg == "--runs") runs = std::max(1, std::atoi(argv[i+1]));
+        else if(arg == "--events") nEvents = std::max(1, std::atoi(argv[i+1]));
+        else if(arg == "--maxThreads") maxThreads = std::max(1, std::atoi(argv[i+1]));
+        else
+        {
+            std::cerr << "usage: " << argv[0] << " [--label <commit>] [--runs <n>] [--events <n>] [--maxThreads <n>]" << std::endl;
+            return -1;
+        }
+    }
+
+    char hostname[256] = "unknown";
+    gethostname(hostname, sizeof(hostname) - 1);
+    std::string prefix = std::string(hostname) + "," + cpuName() + "," + label + ",";
+
+    std::vector<int> threads;
+    for(int t = 1; t < maxThreads; t *= 2) threads.push_back(t);
+    threads.push_back(maxThreads);
+
+    std::cout << "host,cpu,label,primitive,width,height,ksize,precision,threads,ops,median_ns,min_ns" << std::endl;
+    auto row = [&](const std::string &primitive, const Resolution &r, int k, int depth, int t, size_t ops, double median, double best)
+    {
+        std::cout << prefix << primitive << "," << r.width << "," << r.height << "," << k << ","
+                  << (depth == CV_32F ? "32F" : "64F") << "," << t << "," << ops << ","
+                  << median << "," << best << std::endl;
+    };
+
+    double median, best;
+    int batchDiffers = 0;
+    for(auto &r : resolutions)
+    {
+        for(int depth : depths)
+        {
+            // per event primitives run on the event thread only
+            cv::setNumThreads(1);
+            std::vector<Event> events = makeEvents(r, nEvents);
+
+            cv::Mat sae(r.height, r.width, depth, cv::Scalar(0));
+            cv::Mat img(r.height, r.width, depth, cv::Scalar(0));
+            if(depth == CV_32F)
+                measure(runs, events.size(), [&]{liteUpdate<float>(sae, img, events);}, median, best);
+            else
+                measure(runs, events.size(), [&]{liteUpdate<double>(sae, img, events);}, median, best);
+            row("liteUpdate", r, 1, depth, 1, events.size(), median, best);
+            sink += cv::sum(img)[0];
+
+            cv::Mat state(r.height, r.width, CV_MAKETYPE(depth, 2), cv::Scalar(0, 0));
+            if(depth == CV_32F)
+                measure(runs, events.size(), [&]{liteUpdateInterleaved<float>(state, events);}, median, best);
+            else
+                measure(runs, events.size(), [&]{liteUpdateInterleaved<double>(state, events);}, median, best);
+            row("liteUpdateInterleaved", r, 1, depth, 1, events.size(), median, best);
+            sink += cv::sum(state)[1];
+
+            for(int k : kSizes)
+            {
+                int pad = (k - 1)/2;
+                cv::Mat kernel = cv::getGaussianKernel(k, -1, depth);
+                kernel = kernel*kernel.t();
+                cv::Mat psae(r.height + 2*pad, r.width + 2*pad, depth, cv::Scalar(0));
+                cv::Mat pimg(r.height + 2*pad, r.width + 2*pad, depth, cv::Scalar(0));
+                cv::Mat coefs(k, k, depth), decay(k, k, depth);
+                std::vector<Event> fewer(events.begin(), events.begin() + std::min<size_t>(events.size(), nEvents/k + 1));
+
+                cv::setNumThreads(1);
+                measure(runs, fewer.size(), [&]{refPatch(psae, pimg, kernel, fewer, coefs, decay);}, median, best);
+                row("refPatch", r, k, depth, 1, fewer.size(), median, best);
+                sink += cv::sum(pimg)[0];
+
+                cv::Mat pstate = cv::Mat::zeros(r.height + 2*pad, r.width + 2*pad, CV_MAKETYPE(depth, 2));
+                cv::Mat scratch(k, k, depth);
+                if(depth == CV_32F)
+                    measure(runs, fewer.size(), [&]{refPatchInterleaved<float>(pstate, kernel, fewer, scratch, coefs, decay);}, median, best);
+                else
+                    measure(runs, fewer.size(), [&]{refPatchInterleaved<double>(pstate, kernel, fewer, scratch, coefs, decay);}, median, best);
+                row("refPatchInterleaved", r, k, depth, 1, fewer.size(), median, best);
+                sink += cv::sum(pstate)[1];
+
+                cv::Mat batchCoefs(batch, k*k, depth), batchDecay(batch, k*k, depth);
+                measure(runs, fewer.size(), [&]{refBatch(psae, pimg, kernel, fewer, batchCoefs, batchDecay);}, median, best);
+                row("refBatch", r, k, depth, 1, fewer.size(), median, best);
+                sink += cv::sum(pimg)[0];
+                if(!checkBatch(r, kernel, depth, fewer))
+                    batchDiffers++;
+            }
+
+            for(int t : threads)
+            {
+                cv::setNumThreads(t);
+                cv::Mat dt(r.height, r.width, depth), decays(r.height, r.width, depth), updated(r.height, r.width, depth);
+                std::vector<cv::Mat> planes(1, decays);
+                measure(runs, 1, [&]{frameDecay(sae, img, events.back().ts, dt, planes, decays, updated);}, median, best);
+                row("frameDecay", r, 1, depth, t, 1, median, best);
+                sink += cv::sum(updated)[0];
+
+                for(int k : kSizes)
+                {
+                    cv::Mat kernel = cv::getGaussianKernel(k, -1, depth);
+                    kernel = kernel*kernel.t();
+                    cv::Mat convolved(r.height, r.width, depth);
+                    measure(runs, 1, [&]{cv::filter2D(updated, convolved, depth, kernel);}, median, best);
+                    row("filter2D", r, k, depth, t, 1, median, best);
+                    sink += cv::sum(convolved)[0];
+                }
+            }
+        }
+    }
+
+    if(batchDiffers)
+        std::cerr << batchDiffers << " refBatch configurations are not identical to refPatch" << std::endl;
+    std::cerr << "checksum " << sink << std::endl;
+    return 0;
+}
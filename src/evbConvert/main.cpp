@@ -0,0 +1,119 @@
+/******************************************************************************
+                                                                              *
+ * Copyright (C) 2019 Fondazione Istituto Italiano di Tecnologia (IIT)        *
+ * All Rights Reserved.                                                       *
+                                                                              *
+                                                                              */
+
+/**
+ * @file src/evbConvert/main.cpp
+ * @authors: Leandro de Souza Rosa <leandro.desouzarosa@iit.it>
+ *
+ * Converts an HDR dataset sequence (.txt) into the EVB binary format.
+ * The .txt format is:
+ *    - 1st row = sensors dimensions as [dimX dimY]
+ *    - other rows = dvs events expressed as [ts x y pol]
+ *
+ * usage: evbConvert <sequence.txt> <sequence.evb>
+ */
+
+#include "evbFile.h"
+
+#include <cstdio>
+#include <cmath>
+#include <iostream>
+
+using namespace ev;
+
+int main(int argc, char * argv[])
+{
+    if(argc != 3)
+    {
+        std::cout << "usage: " << argv[0] << " <sequence.txt> <sequence.evb>" << std::endl;
+        return -1;
+    }
+
+    FILE *in = std::fopen(argv[1], "r");
+    if(!in)
+    {
+        std::cout << "Could not open " << argv[1] << std::endl;
+        return -1;
+    }
+    FILE *out = std::fopen(argv[2], "wb");
+    if(!out)
+    {
+        std::cout << "Could not open " << argv[2] << std::endl;
+        std::fclose(in);
+        return -1;
+    }
+
+    EvbHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, EVB_MAGIC, 4);
+    header.version = EVB_VERSION;
+    header.eventSize = sizeof(AE);
+
+    if(std::fscanf(in, "%u %u", &header.width, &header.height) != 2)
+    {
+        std::cout << argv[1] << " does not start with the sensor dimensions" << std::endl;
+        std::fclose(in);
+        std::fclose(out);
+        return -1;
+    }
+
+    // the header is rewritten once the number of events is known
+    std::fwrite(&header, sizeof(header), 1, out);
+
+    // events are written in chunks to keep the number of syscalls low
+    std::vector<AE> chunk;
+    chunk.reserve(1<<16);
+
+    double ts, ts0 = 0.0;
+    unsigned int x, y;
+    int pol;
+    uint64_t dropped = 0;
+
+    while(std::fscanf(in, "%lf %u %u %d", &ts, &x, &y, &pol) == 4)
+    {
+        if(header.count == 0 && chunk.empty()) ts0 = ts;
+        header.duration = ts - ts0;
+
+        AE e = AE();
+        // same timer the camera would use, wrapping at max_stamp
+        e.stamp = static_cast<int>(std::llround(header.duration*vtsHelper::vtsscaler)
+                                   & vtsHelper::max_stamp);
+        e.x = x;
+        e.y = y;
+        e.polarity = pol == 1;
+
+        // the codec bit fields might be too narrow for the sensor
+        if(e.x != x || e.y != y)
+        {
+            dropped++;
+            continue;
+        }
+
+        chunk.push_back(e);
+        if(chunk.size() == chunk.capacity())
+        {
+            std::fwrite(chunk.data(), sizeof(AE), chunk.size(), out);
+            header.count += chunk.size();
+            chunk.clear();
+        }
+    }
+    std::fwrite(chunk.data(), sizeof(AE), chunk.size(), out);
+    header.count += chunk.size();
+
+    std::fseek(out, 0, SEEK_SET);
+    std::fwrite(&header, sizeof(header), 1, out);
+
+    std::fclose(in);
+    std::fclose(out);
+
+    std::cout << argv[2] << ": " << header.count << " events, " << header.width << "x" << header.height
+              << ", " << header.duration << " s" << std::endl;
+    if(dropped)
+        std::cout << "WARNING: " << dropped << " events did not fit the AE codec and were dropped" << std::endl;
+
+    return 0;
+}
@@ -17,89 +17,357 @@ void UpdateAndConvolve::initialise(
         cv::Mat &m_img,
         cv::Mat &convolved_img,
         cv::Mat &m_kernel,
-        double m_alpha,
+        const std::vector<double> &m_alphas,
         double *last_ts,
         std::string m_name,
         unsigned int m_height,
         unsigned int m_width,
-        bool *m
+        SnapshotScheduler *m_scheduler
         #if LOG==1
             , std::vector<std::tuple<int, double, double>> *data
         #endif
+        #ifdef INTERLEAVED
+            , cv::Mat &m_state
+        #endif
 )
 {
     sae = m_sae;
     img = m_img;
     convolved = convolved_img;
     kernel = m_kernel;
-    alpha = m_alpha;
+    alphas = m_alphas;
     img_ts = last_ts; 
     name = m_name;
-    mlock = m;
+    scheduler = m_scheduler;
     #if LOG==1
         d = data;
     #endif
+    int n = static_cast<int>(alphas.size());
+    #ifdef INTERLEAVED
+        // contiguous planes for the snapshot, filled from the interleaved state
+        state = m_state;
+        sae = cv::Mat(m_height, m_width, CV_64F, cv::Scalar(0));
+        img = cv::Mat::zeros(m_height, m_width, CV_64FC(n));
+        // channel 0 is the sae, then one channel per alpha
+        for(int c = 0; c <= n; c++)
+        {
+            fromTo.push_back(c);
+            fromTo.push_back(c);
+        }
+    #endif
     
-    coefs = cv::Mat(m_height, m_width, CV_64F, cv::Scalar(0));
-    decays = cv::Mat(m_height, m_width, CV_64F, cv::Scalar(0));
-    updated_img = cv::Mat(m_height, m_width, CV_64F, cv::Scalar(0));
-    norm_img = cv::Mat(m_height, m_width, CV_64F, cv::Scalar(0));
+    dt = cv::Mat(m_height, m_width, CV_64F, cv::Scalar(0));
+    decays = cv::Mat::zeros(m_height, m_width, CV_64FC(n));
+    updated_img = cv::Mat::zeros(m_height, m_width, CV_64FC(n));
+    if(n == 1)
+    {
+        // single alpha: the decays are computed in place
+        decayPlanes.push_back(decays);
+    }
+    else
+    {
+        for(int k = 0; k < n; k++)
+            decayPlanes.push_back(cv::Mat(m_height, m_width, CV_64F, cv::Scalar(0)));
+    }
+}
+
+void UpdateAndConvolve::initialisePyramid(
+        const std::vector<double> &m_scales,
+        const std::vector<int> &m_scaleLevels,
+        const std::vector<int> &m_levelShift,
+        const std::vector<cv::Mat> &m_levelSae,
+        const std::vector<cv::Mat> &m_levelImg,
+        unsigned int m_check
+)
+{
+    levelSae = m_levelSae;
+    levelImg = m_levelImg;
+    check = m_check;
+    for(auto &l : levelSae)
+    {
+        levelCoefs.push_back(cv::Mat(l.rows, l.cols, CV_64F, cv::Scalar(0)));
+        levelUpdated.push_back(cv::Mat(l.rows, l.cols, CV_64F, cv::Scalar(0)));
+    }
+
+    for(size_t i = 0; i < m_scales.size(); i++)
+    {
+        PyramidScale s;
+        s.sigma = m_scales[i];
+        s.level = m_scaleLevels[i];
+        s.index = static_cast<int>(std::find(m_levelShift.begin(), m_levelShift.end(), s.level) - m_levelShift.begin());
+
+        // the 2^l box adds (4^l-1)/12 to the variance and the linear upsampling about
+        // 4^l/6 (a triangle 2^l pixels wide), the coarse gaussian adds the rest
+        double boxes = static_cast<double>(1 << 2*s.level);
+        double coarse = s.level ? std::sqrt(std::max((s.sigma*s.sigma - (boxes - 1)/12)/boxes - 1.0/6, 0.0)) : s.sigma;
+        s.kernel = cv::getGaussianKernel(2*static_cast<int>(std::ceil(3*coarse)) + 1, coarse, CV_64F);
+        // box sums to box means
+        s.kernel = s.kernel*s.kernel.t()/boxes;
+
+        s.fullKernel = cv::getGaussianKernel(2*static_cast<int>(std::ceil(3*s.sigma)) + 1, s.sigma, CV_64F);
+        s.fullKernel = s.fullKernel*s.fullKernel.t();
+
+        if(s.level == 0)
+        {
+            s.index = -1;
+            s.convolved = cv::Mat(convolved.rows, convolved.cols, CV_64F, cv::Scalar(0));
+        }
+        else
+        {
+            const cv::Mat &l = levelSae[s.index];
+            s.convolved = cv::Mat(l.rows, l.cols, CV_64F, cv::Scalar(0));
+            // the level size times 2^l covers the image, cropped after upsampling
+            s.upsampled = cv::Mat(l.rows << s.level, l.cols << s.level, CV_64F, cv::Scalar(0));
+        }
+        scales.push_back(s);
+    }
+    planes.resize(scales.size());
+    checkRef = cv::Mat(convolved.rows, convolved.cols, CV_64F, cv::Scalar(0));
+}
+
+void UpdateAndConvolve::convolvePyramid(cv::Mat &out, double ts)
+{
+    // decay the coarse levels to ts, as the full resolution image
+    for(size_t l = 0; l < levelSae.size(); l++)
+    {
+        levelCoefs[l] = alphas[0]*(levelSae[l] - ts);
+        cv::exp(levelCoefs[l], levelCoefs[l]);
+        levelUpdated[l] = levelImg[l].mul(levelCoefs[l]);
+    }
+
+    bool checking = check && (checked++ % check) == 0;
+    for(size_t i = 0; i < scales.size(); i++)
+    {
+        PyramidScale &s = scales[i];
+        double tic = yarp::os::Time::now();
+        if(s.level == 0)
+        {
+            cv::filter2D(updated_img, s.convolved, CV_64F, s.kernel);
+            planes[i] = s.convolved;
+        }
+        else
+        {
+            // linear upsampling puts each box value at the centre of its 2^l x 2^l pixels
+            cv::filter2D(levelUpdated[s.index], s.convolved, CV_64F, s.kernel);
+            cv::resize(s.convolved, s.upsampled, s.upsampled.size(), 0, 0, cv::INTER_LINEAR);
+            planes[i] = s.upsampled(cv::Rect(0, 0, convolved.cols, convolved.rows));
+        }
+
+        if(checking)
+        {
+            double toc = yarp::os::Time::now();
+            cv::filter2D(updated_img, checkRef, CV_64F, s.fullKernel);
+            s.pyramidTime += toc - tic;
+            s.referenceTime += yarp::os::Time::now() - toc;
+            s.sqErr += cv::norm(planes[i], checkRef, cv::NORM_L2SQR);
+            s.sqRef += cv::norm(checkRef, cv::NORM_L2SQR);
+            s.maxErr = std::max(s.maxErr, cv::norm(planes[i], checkRef, cv::NORM_INF));
+        }
+    }
+    cv::merge(planes, out);
 }
 
 void UpdateAndConvolve::run()
 {
-    while(!isStopping())
+    placement.apply();
+
+    #ifdef PROFILE
+        PerfProfiler perf("snapshot");
+        perf.open();
+        #ifdef INTERLEAVED
+            int pSplit = perf.addSection("split", "snapshot");
+        #endif
+        int pDecay = perf.addSection("decay", "snapshot");
+        int pExp = perf.addSection("exp", "snapshot");
+        int pMul = perf.addSection("mul", "snapshot");
+        int pFilter = perf.addSection("filter2D", "snapshot");
+    #endif
+
+    // sleeps until the scheduler decides a snapshot is due
+    while(scheduler->wait())
     {
-        if(*mlock){
-            #if LOG==1
-                double tic = yarp::os::Time::now();
+        #if LOG==1
+            double tic = yarp::os::Time::now();
+        #endif
+
+        // the time every channel is decayed to, the event thread keeps moving *img_ts
+        const double ts = *img_ts;
+
+        #ifdef PROFILE
+            perf.start();
+        #endif
+
+        #ifdef INTERLEAVED
+            cv::Mat split[] = {sae, img};
+            cv::mixChannels(&state, 1, split, 2, fromTo.data(), fromTo.size()/2);
+            #ifdef PROFILE
+                perf.lap(pSplit);
             #endif
-           
-            // calculate the exponent of the decay for the whole img
-            coefs = alpha*(sae - *img_ts);
-   
-            // compute the decays = e^(-alpha*dt) - saves on "decays" mat
-            cv::exp(coefs, decays);
+        #endif
+       
+        // time since the last event of each pixel, read once from the SAE for all the alphas
+        frameDt(sae, ts, dt);
+        #ifdef PROFILE
+            perf.lap(pDecay);
+        #endif
+
+        // compute the decays = e^(-alpha*dt) - saves on "decays" mat
+        frameDecays(dt, alphas.data(), static_cast<int>(alphas.size()), decayPlanes, decays);
+        #ifdef PROFILE
+            perf.lap(pExp);
+        #endif
    
-            // create updated image by decaying all pixels to the last ts
-            updated_img = img.mul(decays);
+        // create updated image by decaying all pixels to the last ts
+        // (each channel by the decay of its alpha)
+        updated_img = img.mul(decays);
+        #ifdef PROFILE
+            perf.lap(pMul);
+        #endif
    
-            // apply convolution
-            cv::filter2D(updated_img, convolved, CV_64F, kernel);
-        
-            #if LOG==1
-                d->push_back(std::tuple<int, double, double>(1, tic, (yarp::os::Time::now()-tic)));
+        // apply convolution to every channel, straight into the shared memory ring if enabled
+        cv::Mat out = shm ? cv::Mat(convolved.rows, convolved.cols, convolved.type(), shm->begin()) : convolved;
+        if(scales.empty())
+            cv::filter2D(updated_img, out, CV_64F, kernel);
+        else
+            convolvePyramid(out, ts);
+        #ifdef PROFILE
+            perf.stop(pFilter);
+        #endif
+        if(shm)
+        {
+            shm->commit(ts);
+            #if LOG==2
+                out.copyTo(convolved);
             #endif
+        }
+    
+        #if LOG==1
+            d->push_back(std::tuple<int, double, double>(1, tic, (yarp::os::Time::now()-tic)));
+        #endif
    
-            #ifdef VIS
-                normalize(convolved, norm_img, 0, 1, NORM_MINMAX);
-                cv::imshow(name, (1-norm_img));// invert colours
-                cv::waitKey(1);
-            #endif
-            *mlock = false;
-        } // if mlock
-    }// while !isStopping()
+        #ifdef VIS
+            render->publish(out);
+        #endif
+        scheduler->finish(ts);
+    }// while scheduler->wait()
+
+    #ifdef PROFILE
+        perf.report();
+    #endif
+    scheduler->report();
+
+    // accuracy of the pyramid against the full resolution kernels
+    unsigned int nChecks = check ? (checked + check - 1)/check : 0;
+    for(auto &s : scales)
+    {
+        if(!nChecks || s.sqRef <= 0) continue;
+        yInfo() << name << ": sigma" << s.sigma << "at level" << s.level << "with a" << s.kernel.rows << "x" << s.kernel.cols
+                << "kernel | RMSE" << std::sqrt(s.sqErr/(nChecks*convolved.total())) << "relative" << std::sqrt(s.sqErr/s.sqRef)
+                << "max" << s.maxErr << "|" << 1e3*s.pyramidTime/nChecks << "ms vs" << 1e3*s.referenceTime/nChecks
+                << "ms with the" << s.fullKernel.rows << "x" << s.fullKernel.cols << "kernel";
+    }
 }// run()
 
+void UpdateAndConvolve::onStop()
+{
+    scheduler->stop();
+}
+
 bool LiteConv::configure(yarp::os::ResourceFinder& rf)
 {
     
     // open yarp ports (in/out) associated to the module
     setName((rf.check("name", yarp::os::Value("/liteConv")).asString()).c_str());
 
+    // cpu affinity and SCHED_FIFO priority, applied by each thread when it starts
+    m_eventPlacement.configure(rf, "event");
+    asapThread.placement.configure(rf, "snapshot");
+
+    // Events come either from an EVB file or from the input port
+    std::string evFile = rf.check("evFile", yarp::os::Value("")).asString();
+    m_fromFile = !evFile.empty();
+    if(m_fromFile)
+    {
+        if(!m_evFile.open(evFile))
+            return false;
+        int packetSize = rf.check("evPacket", yarp::os::Value(1000)).asInt32();
+        if(packetSize <= 0)
+        {
+            yError() << "evPacket must be positive";
+            return false;
+        }
+        m_packetSize = static_cast<unsigned int>(packetSize);
+        yInfo() << "Replaying" << evFile << ":" << static_cast<double>(m_evFile.size()) << "events," << m_evFile.duration() << "s";
+    }
     // Open YARP ports (in/out) associated to the module
-    if(!m_inPort.open(getName()+"/AE:i"))
+    else if(!m_inPort.open(getName()+"/AE:i"))
     {
         yError() << "Could not open input port";
         return false;
     }
     
     /* set parameters */
-    m_height = static_cast<unsigned int>(rf.check("height", yarp::os::Value(480)).asInt32());
-    m_width = static_cast<unsigned int>(rf.check("width", yarp::os::Value(640)).asInt32());
+    m_height = static_cast<unsigned int>(rf.check("height", yarp::os::Value(m_fromFile ? static_cast<int>(m_evFile.height()) : 480)).asInt32());
+    m_width = static_cast<unsigned int>(rf.check("width", yarp::os::Value(m_fromFile ? static_cast<int>(m_evFile.width()) : 640)).asInt32());
+
+    // in-process vPreProcess, the surfaces take the size of the region of interest
+    if(!m_preFilter.configure(rf, m_width, m_height))
+        return false;
+    m_width = m_preFilter.width();
+    m_height = m_preFilter.height();
+
     m_alpha = static_cast<double>(rf.check("alpha", yarp::os::Value(1*M_PI)).asFloat64());
     m_ksize = static_cast<unsigned int>(rf.check("kSize", yarp::os::Value(3)).asInt32());
     m_sigma = static_cast<double>(rf.check("sigma", yarp::os::Value(0.3)).asFloat64());
+
+    // temporal bank, e.g. --alphas "(1.0 3.14 10.0)": one surface per alpha from the same SAE
+    m_alphas.clear();
+    yarp::os::Bottle *alphas = rf.find("alphas").asList();
+    if(alphas)
+    {
+        for(size_t i = 0; i < alphas->size(); i++)
+            m_alphas.push_back(alphas->get(i).asFloat64());
+    }
+    if(m_alphas.empty())
+        m_alphas.push_back(m_alpha);
+    m_alpha = m_alphas.front();
+    m_nAlphas = static_cast<int>(m_alphas.size());
+    if(m_nAlphas > CV_CN_MAX - 1)
+    {
+        yError() << "At most" << CV_CN_MAX - 1 << "alphas";
+        return false;
+    }
+
+    // pyramid mode, e.g. --scales "(0.5 4 16)": one snapshot channel per gaussian sigma,
+    // the large ones convolved on coarse levels of the surface
+    yarp::os::Bottle *scales = rf.find("scales").asList();
+    m_pyramid = scales && scales->size() > 0;
+    if(m_pyramid)
+    {
+        if(m_nAlphas > 1)
+        {
+            yError() << "The pyramid mode takes a single alpha";
+            return false;
+        }
+        // the coarsest level where a scale is still pyramidBase coarse pixels
+        double base = rf.check("pyramidBase", yarp::os::Value(2.0)).asFloat64();
+        for(size_t i = 0; i < scales->size(); i++)
+        {
+            double sigma = scales->get(i).asFloat64();
+            if(sigma <= 0 || base <= 0)
+            {
+                yError() << "scales and pyramidBase must be positive";
+                return false;
+            }
+            int l = sigma >= 2*base ? static_cast<int>(std::floor(std::log2(sigma/base))) : 0;
+            while(l > 0 && (std::min(m_height, m_width) >> l) < 8)
+                l--;
+            m_scales.push_back(sigma);
+            m_scaleLevels.push_back(l);
+            if(l > 0 && std::find(m_levelShift.begin(), m_levelShift.end(), l) == m_levelShift.end())
+                m_levelShift.push_back(l);
+        }
+    }
     
     if (m_ksize%2==0 || m_ksize <= 0)
     {
@@ -110,10 +378,53 @@ bool LiteConv::configure(yarp::os::ResourceFinder& rf)
     m_kernel = cv::getGaussianKernel(m_ksize, m_sigma);
     m_kernel = m_kernel*m_kernel.t();
    
-    // intermediate image
-    m_img = cv::Mat(m_height, m_width, CV_64F, cv::Scalar(0)); 
-    // SAE
-    m_sae = cv::Mat(m_height, m_width, CV_64F, cv::Scalar(0));
+    #ifdef INTERLEAVED
+        // SAE and intermediate images interleaved, an event touches a single cache line
+        m_state = cv::Mat::zeros(m_height, m_width, CV_64FC(1 + m_nAlphas));
+    #else
+        // intermediate image, one channel per alpha
+        m_img = cv::Mat::zeros(m_height, m_width, CV_64FC(m_nAlphas)); 
+        // SAE
+        m_sae = cv::Mat(m_height, m_width, CV_64F, cv::Scalar(0));
+    #endif
+
+    // coarse levels, a pixel per 2^l x 2^l box (partial boxes on the right and bottom edges)
+    for(int l : m_levelShift)
+    {
+        int rows = (m_height + (1 << l) - 1) >> l;
+        int cols = (m_width + (1 << l) - 1) >> l;
+        m_levelSae.push_back(cv::Mat(rows, cols, CV_64F, cv::Scalar(0)));
+        m_levelImg.push_back(cv::Mat(rows, cols, CV_64F, cv::Scalar(0)));
+    }
+
+    // periodic checkpoint of the surfaces, restored on a warm restart
+    std::string checkpoint = rf.check("checkpoint", yarp::os::Value("")).asString();
+    m_checkpointing = !checkpoint.empty();
+    if(m_checkpointing)
+    {
+        #ifdef INTERLEAVED
+            std::vector<cv::Mat> surfaces = {m_state};
+        #else
+            std::vector<cv::Mat> surfaces = {m_sae, m_img};
+        #endif
+        if(!m_checkpoint.initialise(checkpoint, surfaces, &last_ts, rf.check("checkpointPeriod", yarp::os::Value(1.0)).asFloat64()))
+            return false;
+
+        double ts;
+        if(m_checkpoint.restore(ts, m_restoredAt))
+        {
+            // rebase the SAE so that the checkpoint happens at t=0, the first
+            // new event then continues at the downtime
+            #ifdef INTERLEAVED
+                m_state.reshape(1, m_height*m_width).col(0) -= ts;
+            #else
+                m_sae -= ts;
+            #endif
+            rebuildLevels();
+            m_restored = true;
+            yInfo() << "Surfaces restored from" << checkpoint;
+        }
+    }
 
     #if LOG==0 || LOG==1 || LOG==2
         yInfo() << "Logging input port delay";
@@ -140,17 +451,38 @@ bool LiteConv::configure(yarp::os::ResourceFinder& rf)
         log.open(logFileName, std::ofstream::out | std::ofstream::trunc);
     #endif
 
+    m_fps = static_cast<unsigned int>(rf.check("fps", yarp::os::Value(30)).asInt32());
+    
+    // snapshot, one channel per alpha (or per scale in pyramid mode)
+    convolved_img = cv::Mat::zeros(m_height, m_width, CV_64FC(m_pyramid ? static_cast<int>(m_scales.size()) : m_nAlphas)); 
+
+    // when to compute the snapshots, and a port to request them
+    if(!m_scheduler.configure(rf))
+        return false;
+    if(!m_rpcPort.open(getName() + "/rpc"))
+        return false;
+    attach(m_rpcPort);
+
+    // shared memory ring for co-located readers, see shmFrames.h
+    std::string shmName = rf.check("shm", yarp::os::Value("")).asString();
+    if(!shmName.empty())
+    {
+        unsigned int slots = static_cast<unsigned int>(rf.check("shmSlots", yarp::os::Value(4)).asInt32());
+        if(!m_shm.open(shmName, m_height, m_width, convolved_img.type(), convolved_img.elemSize(), slots))
+        {
+            yError() << "Could not create the shared memory ring" << shmName << "(at least 2 slots)";
+            return false;
+        }
+        asapThread.shm = &m_shm;
+        yInfo() << "Publishing the snapshots in shared memory" << shmName << "with" << static_cast<int>(slots) << "slots";
+    }
+
     #ifdef VIS
-        m_fps = static_cast<unsigned int>(rf.check("fps", yarp::os::Value(30)).asInt32());
-        
-        // Initiate the VIS matrices
-        convolved_img = cv::Mat(m_height, m_width, CV_64F, cv::Scalar(0)); 
-
-        // Create window for visualisation
-        cv::namedWindow(getName(), cv::WINDOW_NORMAL);
-        cv::resizeWindow(getName(), 800, 800);
-        cv::waitKey(1);
-        m = false;
+        // the render thread displays the latest snapshot at m_fps, skipping the others
+        m_render.initialise(getName(), m_fps, rf.check("visScale", yarp::os::Value(1.0)).asFloat64());
+        m_render.placement.configure(rf, "render");
+        m_render.placement.priority = 0; // the display never runs real-time
+        asapThread.render = &m_render;
     #endif
     
     // configure and start the baby thread
@@ -159,18 +491,48 @@ bool LiteConv::configure(yarp::os::ResourceFinder& rf)
             m_img,
             convolved_img,
             m_kernel,
-            m_alpha,
+            m_alphas,
             &last_ts,
             getName(),
             m_height,
             m_width,
-            &m
+            &m_scheduler
             #if LOG==1
                 , &data
             #endif
+            #ifdef INTERLEAVED
+                , m_state
+            #endif
             );
 
+    if(m_pyramid)
+    {
+        asapThread.initialisePyramid(
+                m_scales,
+                m_scaleLevels,
+                m_levelShift,
+                m_levelSae,
+                m_levelImg,
+                static_cast<unsigned int>(rf.check("pyramidCheck", yarp::os::Value(0)).asInt32()));
+    }
+
+    // lock the surfaces (already pre-faulted by their initialisation) in RAM
+    if(rf.check("mlock"))
+    {
+        if(!lockMemory())
+            return false;
+        // but not the replayed file
+        if(m_fromFile)
+            m_evFile.unlock();
+    }
+
     yInfo() << getName() << " module configured";
+    #ifdef VIS
+        if(!m_render.start())
+            return false;
+    #endif
+    if(m_checkpointing && !m_checkpoint.start())
+        return false;
     return Thread::start() && asapThread.start();
 }
 
@@ -181,6 +543,11 @@ double LiteConv::getPeriod()
                                              
 bool LiteConv::interruptModule()
 {
+    if(m_checkpointing)
+        m_checkpoint.stop();
+    #ifdef VIS
+        m_render.stop();
+    #endif
     return Thread::stop() && asapThread.stop();
 }
                                               
@@ -188,6 +555,7 @@ void LiteConv::onStop()
 {
     //close ports etc.
     m_inPort.close();   
+    m_rpcPort.close();
 
     #if LOG==0
         for( auto d : data)
@@ -205,7 +573,6 @@ void LiteConv::onStop()
         log.close();
     #endif
             
-    cv::destroyAllWindows();    
     return;
 }
 
@@ -214,42 +581,132 @@ bool LiteConv::updateModule()
     return Thread::isRunning() && asapThread.isRunning();
 }
 
+bool LiteConv::respond(const yarp::os::Bottle& command, yarp::os::Bottle& reply)
+{
+    if(m_scheduler.respond(command, reply))
+        return true;
+    return RFModule::respond(command, reply);
+}
+
+void LiteConv::rebuildLevels()
+{
+    // decay every pixel to last_ts, the time of all the boxes, and sum them
+    for(size_t i = 0; i < m_levelShift.size(); i++)
+    {
+        int l = m_levelShift[i];
+        m_levelSae[i] = cv::Scalar(last_ts);
+        m_levelImg[i] = cv::Scalar(0);
+        for(unsigned int y = 0; y < m_height; y++)
+        {
+            for(unsigned int x = 0; x < m_width; x++)
+            {
+                #ifdef INTERLEAVED
+                    const double *px = m_state.ptr<double>(y) + x*(1 + m_nAlphas);
+                    double sae = px[0], v = px[1];
+                #else
+                    double sae = m_sae.at<double>(y, x), v = m_img.at<double>(y, x);
+                #endif
+                m_levelImg[i].at<double>(y >> l, x >> l) += v*exp(m_alpha*(sae - last_ts));
+            }
+        }
+    }
+}
+
 void LiteConv::run()
 {
+    m_eventPlacement.apply();
+
     // using the vtsHelper for arith straight-forwardly was leanding to errors
     int maxTimestamp = static_cast<int>(ev::vtsHelper::max_stamp);
     
     Stamp yarpstamp;    
    
     int prev_tick = 0;
+
+    #ifdef PROFILE
+        PerfProfiler perf("event");
+        perf.open();
+        int pPreFilter = perf.addSection("preFilter", "event");
+        int pUpdate = perf.addSection("update", "event");
+    #endif
     
     while(true)
     {
-        const vector<AE> * q = m_inPort.read(yarpstamp);
-        if(!q || Thread::isStopping()) return;              
+        EvSpan q;
+        if(m_fromFile)
+        {
+            if(!m_evFile.next(q, m_packetSize) || Thread::isStopping())
+            {
+                yInfo() << "End of the EVB file";
+                break;
+            }
+            yarpstamp.update();
+        }
+        else
+        {
+            const vector<AE> * qp = m_inPort.read(yarpstamp);
+            if(!qp || Thread::isStopping()) break;
+            q = EvSpan(*qp);
+        }
+
+        if(m_preFilter.enabled())
+        {
+            #ifdef PROFILE
+                perf.start();
+                size_t received = q.size();
+            #endif
+            q = m_preFilter.apply(q);
+            #ifdef PROFILE
+                perf.stop(pPreFilter, received);
+            #endif
+            if(q.empty()) continue;
+        }
+
+        // continue the timeline of the restored surfaces from the first event
+        if(m_restored && !q.empty())
+        {
+            // the downtime includes the wait for the source
+            last_ts = std::max(0.0, yarp::os::Time::now() - m_restoredAt);
+            prev_tick = q.begin()->stamp;
+            m_restored = false;
+            yInfo() << "Restored timeline continues after" << last_ts << "s";
+        }
 
         #if LOG==1
             double tic = yarp::os::Time::now();
         #endif
+
+        #ifdef PROFILE
+            perf.start();
+        #endif
         
-        for(auto& qi:*q) // For each event
+        for(auto& qi:q) // For each event
         {
             last_ts += ev::vtsHelper::deltaS(qi.stamp, prev_tick); 
             prev_tick = qi.stamp;
             
-            // Calculate the decay
-            double decay = exp(m_alpha*(m_sae.at<double>(qi.y, qi.x) - last_ts));
-        
-            if(qi.polarity)
-                m_img.at<double>(qi.y, qi.x) = m_img.at<double>(qi.y, qi.x)*decay + 1;
-            else
-                m_img.at<double>(qi.y, qi.x) = m_img.at<double>(qi.y, qi.x)*decay - 1;
+            #ifdef INTERLEAVED
+                // px[0] is the SAE, px[1...] the image of each alpha
+                double *px = m_state.ptr<double>(qi.y) + qi.x*(1 + m_nAlphas);
+                double &sae = px[0];
+                double *img = px + 1;
+            #else
+                double &sae = m_sae.at<double>(qi.y, qi.x);
+                double *img = m_img.ptr<double>(qi.y) + qi.x*m_nAlphas;
+            #endif
 
-            m_sae.at<double>(qi.y, qi.x) = last_ts;
+            // decay the image of every alpha, add the event and stamp the SAE
+            litePixel(sae, img, m_alphas.data(), m_nAlphas, qi, last_ts);
 
-            #if VIS
-                m = true;
-            #endif
+            // coarse levels: a box sum decays at the rate of its pixels, so it
+            // is updated as a pixel and stays the exact sum of its box
+            for(size_t i = 0; i < m_levelShift.size(); i++)
+            {
+                int l = m_levelShift[i];
+                double &boxSae = m_levelSae[i].at<double>(qi.y >> l, qi.x >> l);
+                double &boxImg = m_levelImg[i].at<double>(qi.y >> l, qi.x >> l);
+                litePixel(boxSae, &boxImg, &m_alpha, 1, qi, last_ts);
+            }
 
             #if LOG==2
                 int idx = (int)(m_ksize-1)/2;
@@ -259,16 +716,31 @@ void LiteConv::run()
                 else
                     pi = -1;
                 
-                log << last_ts << ", " << convolved_img.at<double>(qi.y, qi.x) << ", " << convolved_img.at<double>(qi.y, qi.x)+pi*m_kernel.at<double>(idx, idx) << "\n";
+                // first alpha of the bank (first scale of the pyramid)
+                double conv = convolved_img.ptr<double>(qi.y)[qi.x*convolved_img.channels()];
+                log << last_ts << ", " << conv << ", " << conv+pi*m_kernel.at<double>(idx, idx) << "\n";
             #endif
-        } //for(auto& qi:*q)
+        } //for(auto& qi:q)
+
+        #ifdef PROFILE
+            perf.stop(pUpdate, q.size());
+        #endif
+
+        // the packet is in the surfaces, let the scheduler decide on a snapshot
+        m_scheduler.events(q.size());
         
         #if LOG==0
-            data.push_back(std::tuple<double, double, double>(yarpstamp.getTime(), m_inPort.queryRate(), m_inPort.queryDelayT()));
+            if(!m_fromFile)
+                data.push_back(std::tuple<double, double, double>(yarpstamp.getTime(), m_inPort.queryRate(), m_inPort.queryDelayT()));
         #elif LOG==1
-            double avgtime = (yarp::os::Time::now()-tic)/q->size();
+            double avgtime = (yarp::os::Time::now()-tic)/q.size();
             data.push_back(std::tuple<int, double, double>(0, yarpstamp.getTime(), avgtime));
         #endif
     }
+
+    m_preFilter.report();
+    #ifdef PROFILE
+        perf.report();
+    #endif
 }
 // Empty lines, the way gcc likes
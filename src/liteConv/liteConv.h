@@ -14,6 +14,7 @@
 
 #include <vector>
 #include <iterator>
+#include <algorithm> // std find, std max
 
 #include <fstream>
 #include <iomanip>      // std::setprecision
@@ -23,6 +24,18 @@
 #include <opencv2/imgproc/imgproc.hpp>
 #include <opencv2/features2d.hpp> // ORB descriptor and feature
 
+#include "evbFile.h"
+#include "threadPlacement.h"
+#include "renderThread.h"
+#include "surfaceCheckpoint.h"
+#include "shmFrames.h"
+#include "snapshotScheduler.h"
+#include "preFilter.h"
+#include "convKernels.h"
+#ifdef PROFILE
+    #include "perfCounters.h"
+#endif
+
 #define _USE_MATH_DEFINES 
 #include <cmath>
 
@@ -36,6 +49,21 @@ using namespace std;
     namespace fs = std::experimental::filesystem;
 #endif
 
+/*
+ * A spatial scale of the pyramid mode: the gaussian of sigma, applied on the
+ * box-summed surface of a coarse level and upsampled to the full resolution
+ */
+struct PyramidScale {
+    double sigma; //!< full resolution sigma
+    int level; //!< 0 for the full resolution, l for 2^l x 2^l boxes
+    int index; //!< of the level in the coarse level vectors, -1 at full resolution
+    cv::Mat kernel; //!< coarse kernel, normalised to the box mean
+    cv::Mat convolved, upsampled; //!< at the level, at the level size times 2^l
+    cv::Mat fullKernel; //!< full resolution kernel, for the accuracy check
+    double sqErr{0.0}, sqRef{0.0}, maxErr{0.0}; //!< accuracy against reference
+    double pyramidTime{0.0}, referenceTime{0.0}; //!< s, in the checked snapshots
+};
+
 /**
  * @class LiteConv
  * @ Implements the ASAP update and convolution for our Lite Convolution method
@@ -48,11 +76,28 @@ class UpdateAndConvolve : public Thread {
 
 public:
     cv::Mat sae, img, convolved, kernel;
+    #ifdef INTERLEAVED
+        cv::Mat state; //!< interleaved (sae, img), split into sae and img for each snapshot
+        std::vector<int> fromTo; //!< state channels to (sae, img) channels
+    #endif
     std::string name;
-    double alpha;
+    std::vector<double> alphas; //!< temporal bank, one img channel per alpha
     double *img_ts;
-    cv::Mat coefs, decays, updated_img, norm_img; 
-    bool *mlock;
+    cv::Mat dt, decays, updated_img; //!< time since the last event, decays and decayed img
+    std::vector<cv::Mat> decayPlanes; //!< decays of each alpha, merged into decays
+    SnapshotScheduler *scheduler; //!< wakes this thread when a snapshot is due
+    ThreadPlacement placement; //!< cpu and priority of this thread
+    #ifdef VIS
+        Render *render; //!< display stage, fed with every snapshot
+    #endif
+    ShmFrameWriter *shm{nullptr}; //!< shared memory ring the snapshots are written to, if any
+    std::vector<PyramidScale> scales; //!< pyramid mode, one snapshot channel per scale
+    std::vector<cv::Mat> levelSae, levelImg; //!< coarse levels 1..L of the surfaces
+    std::vector<cv::Mat> levelCoefs, levelUpdated; //!< decayed coarse levels
+    std::vector<cv::Mat> planes; //!< channels of the pyramid snapshot
+    cv::Mat checkRef; //!< full resolution convolution of the checked scale
+    unsigned int check{0}; //!< compare with the full resolution kernels every check snapshots
+    unsigned int checked{0}; //!< pyramid snapshots so far
     std::vector<std::tuple<int, double, double>> *d;
 
     void initialise(
@@ -60,17 +105,44 @@ public:
             cv::Mat &m_img,
             cv::Mat &convolved_img,
             cv::Mat &m_kernel,
-            double m_alpha,
+            const std::vector<double> &m_alphas,
             double *last_ts, std::string m_name,
             unsigned int m_height,
             unsigned int m_width,
-            bool *m
+            SnapshotScheduler *m_scheduler
             #if LOG==1
                 , std::vector<std::tuple<int, double, double>> *data
             #endif
+            #ifdef INTERLEAVED
+                , cv::Mat &m_state
+            #endif
+    );
+
+    /*!
+     * Convolve the levels of the pyramid mode instead of the full
+     * resolution image, after initialise().
+     */
+    void initialisePyramid(
+            const std::vector<double> &m_scales,
+            const std::vector<int> &m_scaleLevels,
+            const std::vector<int> &m_levelShift,
+            const std::vector<cv::Mat> &m_levelSae,
+            const std::vector<cv::Mat> &m_levelImg,
+            unsigned int m_check
     );
     
     void run();
+
+    /*!
+     * Wake up the thread waiting for the next snapshot
+     */
+    void onStop();
+
+private:
+    /*!
+     * One channel of out per scale, from the levels decayed to ts
+     */
+    void convolvePyramid(cv::Mat &out, double ts);
 };
 
 /**
@@ -114,17 +186,43 @@ public:
      */
     bool updateModule();
 
+    /*!
+     * Rpc commands: "snapshot" computes a snapshot and replies once it is
+     * published, "stats" replies the snapshot rate and staleness.
+     */
+    bool respond(const yarp::os::Bottle& command, yarp::os::Bottle& reply);
+
 private:
     vReadPort< vector<AE> > m_inPort; //!< port to receive the events
+    EvbReader m_evFile; //!< memory mapped EVB file, replaces m_inPort if given
+    bool m_fromFile{false}; //!< read the events from m_evFile
+    PreFilter m_preFilter; //!< flip, crop and noise filter of the incoming packets
+    ThreadPlacement m_eventPlacement; //!< cpu and priority of the event thread
+
+    SurfaceCheckpoint m_checkpoint; //!< periodic copy of the surfaces for warm restarts
+    bool m_checkpointing{false}; //!< m_checkpoint is running
+    bool m_restored{false}; //!< surfaces restored, the next event continues their timeline
+    double m_restoredAt{0.0}; //!< wall clock time of the restored checkpoint
+    unsigned int m_packetSize; //!< events per packet when reading from file
     
     unsigned int m_width; //!< image width
     unsigned int m_height; //!< image height
 
-    cv::Mat m_img; //!< Matrix that the convolved image 
+    cv::Mat m_img; //!< Matrix that the convolved image, one channel per alpha
     cv::Mat m_sae; //!< Saves the timestamp of the last event in each image position
+    #ifdef INTERLEAVED
+        cv::Mat m_state; //!< (sae, img...) per pixel, replaces m_sae and m_img
+    #endif
     double last_ts{0.0}; //!< timestamp of the last event
     
     double m_alpha; //!< Cut frequency for high-pass filter
+    std::vector<double> m_alphas; //!< temporal bank of cut frequencies sharing the SAE, m_alpha if not given
+    int m_nAlphas; //!< m_alphas.size(), channels of m_img and of the snapshots
+    bool m_pyramid{false}; //!< convolve large scales on coarse levels
+    std::vector<double> m_scales; //!< gaussian sigmas of the pyramid mode
+    std::vector<int> m_scaleLevels; //!< level each scale is convolved at
+    std::vector<int> m_levelShift; //!< l of each coarse level in use
+    std::vector<cv::Mat> m_levelSae, m_levelImg; //!< SAE and image summed over 2^l x 2^l boxes
     unsigned int m_ksize; //!< convolution kernel size
     double m_sigma; //!< convolution kernel sigma 
     cv::Mat m_kernel; //!< convolution kernel
@@ -146,15 +244,20 @@ private:
     // baby thread    
     UpdateAndConvolve asapThread;
 
-    #if VIS
-        cv::Mat coefs;
-        cv::Mat decays;
-        cv::Mat updated_img;
-        cv::Mat norm_img;
-        cv::Mat convolved_img;
-        bool m{false};
-        unsigned int m_fps;
+    cv::Mat convolved_img; //!< latest snapshot
+    ShmFrameWriter m_shm; //!< zero-copy publication of the snapshots to co-located readers
+    SnapshotScheduler m_scheduler; //!< when the snapshots are computed
+    yarp::os::RpcServer m_rpcPort; //!< snapshot requests and statistics
+    unsigned int m_fps; //!< display rate
+
+    #ifdef VIS
+        Render m_render; //!< displays the snapshots at m_fps
     #endif
+
+    /*!
+     * Sum the (restored) full resolution surfaces into the coarse levels
+     */
+    void rebuildLevels();
 };
 
 #endif
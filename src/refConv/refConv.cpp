@@ -21,10 +21,13 @@ void Update::initialise(
         unsigned int m_height,
         unsigned int m_width,
         unsigned int m_padSize,
-        bool *m
+        SnapshotScheduler *m_scheduler
         #if LOG==1
             , std::vector<std::tuple<int, double, double>> *data
         #endif
+        #ifdef INTERLEAVED
+            , cv::Mat &m_state
+        #endif
 )
 {
     sae = m_sae;
@@ -32,70 +35,148 @@ void Update::initialise(
     alpha = m_alpha;
     img_ts = last_ts; 
     name = m_name;
-    mlock = m;
+    scheduler = m_scheduler;
     width = m_width;
     height = m_height;
     padSize = m_padSize;
     #if LOG==1
         d = data;
     #endif
+    #ifdef INTERLEAVED
+        // contiguous (padded) planes for the snapshot, filled from the interleaved state
+        state = m_state;
+        sae = cv::Mat(height + 2*padSize, width + 2*padSize, CV_64F, cv::Scalar(0));
+        img = cv::Mat(height + 2*padSize, width + 2*padSize, CV_64F, cv::Scalar(0));
+    #endif
    
-    coefs = cv::Mat(height, width, CV_64F, cv::Scalar(0));
+    dt = cv::Mat(height, width, CV_64F, cv::Scalar(0));
     decays = cv::Mat(height, width, CV_64F, cv::Scalar(0)); 
     updated_img = cv::Mat(height, width, CV_64F, cv::Scalar(0));
-    norm_img = cv::Mat(height, width, CV_64F, cv::Scalar(0)); 
+    // single alpha: the decays are computed in place
+    decayPlanes.assign(1, decays);
 }
 
 void Update::run()
 {
-    while(!isStopping())
+    placement.apply();
+
+    #ifdef PROFILE
+        PerfProfiler perf("snapshot");
+        perf.open();
+        #ifdef INTERLEAVED
+            int pSplit = perf.addSection("split", "snapshot");
+        #endif
+        int pDecay = perf.addSection("decay", "snapshot");
+        int pExp = perf.addSection("exp", "snapshot");
+        int pMul = perf.addSection("mul", "snapshot");
+    #endif
+
+    // sleeps until the scheduler decides a snapshot is due
+    while(scheduler->wait())
     {
-        if(*mlock){
-            #ifdef VIS
-                #if LOG==1
-                    double tic = yarp::os::Time::now();
-                #endif
-                
-                // calculate the exponent of the decay for the whole img
-                coefs = alpha*(sae(cv::Rect(padSize, padSize, width, height)) - *img_ts);
-                             
-                // compute the decays = e^(-alpha*dt) - saves on "decays" mat
-                cv::exp(coefs, decays);
-                
-                // create updated image by decaying all pixels to the last ts
-                updated_img = img(cv::Rect(padSize, padSize, width, height)).mul(decays);
-               
-                // TODO: tic is not working properly for exporting to python 
-                #if LOG==1
-                    d->push_back(std::tuple<int, double, double>(1, tic, (yarp::os::Time::now()-tic)));
-                #endif
-                
-                normalize(updated_img, norm_img, 0, 1, NORM_MINMAX);
-                cv::imshow(name, (1-norm_img));// invert colours
-                cv::waitKey(1);
-                
-                *mlock = false;
-            #endif                                     
-        } // if mlock
-    }// while !isStopping()
+        #if LOG==1
+            double tic = yarp::os::Time::now();
+        #endif
+
+        // the time the snapshot is decayed to, the event thread keeps moving *img_ts
+        const double ts = *img_ts;
+
+        #ifdef PROFILE
+            perf.start();
+        #endif
+
+        #ifdef INTERLEAVED
+            cv::Mat planes[] = {sae, img};
+            cv::split(state, planes);
+            #ifdef PROFILE
+                perf.lap(pSplit);
+            #endif
+        #endif
+        
+        // time since the last event of each pixel of the whole img
+        frameDt(sae(cv::Rect(padSize, padSize, width, height)), ts, dt);
+        #ifdef PROFILE
+            perf.lap(pDecay);
+        #endif
+                     
+        // compute the decays = e^(-alpha*dt) - saves on "decays" mat
+        frameDecays(dt, &alpha, 1, decayPlanes, decays);
+        #ifdef PROFILE
+            perf.lap(pExp);
+        #endif
+        
+        // create updated image by decaying all pixels to the last ts
+        updated_img = img(cv::Rect(padSize, padSize, width, height)).mul(decays);
+        #ifdef PROFILE
+            perf.stop(pMul);
+        #endif
+       
+        // TODO: tic is not working properly for exporting to python 
+        #if LOG==1
+            d->push_back(std::tuple<int, double, double>(1, tic, (yarp::os::Time::now()-tic)));
+        #endif
+        
+        #ifdef VIS
+            render->publish(updated_img);
+        #endif
+        
+        scheduler->finish(ts);
+    }// while scheduler->wait()
+
+    #ifdef PROFILE
+        perf.report();
+    #endif
+    scheduler->report();
 }// run()
 
+void Update::onStop()
+{
+    scheduler->stop();
+}
+
 bool RefConv::configure(yarp::os::ResourceFinder& rf)
 {
     
     // open yarp ports (in/out) associated to the module
     setName((rf.check("name", yarp::os::Value("/refConv")).asString()).c_str());
 
+    // cpu affinity and SCHED_FIFO priority, applied by each thread when it starts
+    m_eventPlacement.configure(rf, "event");
+    asapThread.placement.configure(rf, "snapshot");
+
+    // Events come either from an EVB file or from the input port
+    std::string evFile = rf.check("evFile", yarp::os::Value("")).asString();
+    m_fromFile = !evFile.empty();
+    if(m_fromFile)
+    {
+        if(!m_evFile.open(evFile))
+            return false;
+        int packetSize = rf.check("evPacket", yarp::os::Value(1000)).asInt32();
+        if(packetSize <= 0)
+        {
+            yError() << "evPacket must be positive";
+            return false;
+        }
+        m_packetSize = static_cast<unsigned int>(packetSize);
+        yInfo() << "Replaying" << evFile << ":" << static_cast<double>(m_evFile.size()) << "events," << m_evFile.duration() << "s";
+    }
     // Open YARP ports (in/out) associated to the module
-    if(!m_inPort.open(getName()+"/AE:i"))
+    else if(!m_inPort.open(getName()+"/AE:i"))
     {
         yError() << "Could not open input port";
         return false;
     }
     
     /* set parameters */
-    m_height = static_cast<unsigned int>(rf.check("height", yarp::os::Value(480)).asInt32());
-    m_width = static_cast<unsigned int>(rf.check("width", yarp::os::Value(640)).asInt32());
+    m_height = static_cast<unsigned int>(rf.check("height", yarp::os::Value(m_fromFile ? static_cast<int>(m_evFile.height()) : 480)).asInt32());
+    m_width = static_cast<unsigned int>(rf.check("width", yarp::os::Value(m_fromFile ? static_cast<int>(m_evFile.width()) : 640)).asInt32());
+
+    // in-process vPreProcess, the surfaces take the size of the region of interest
+    if(!m_preFilter.configure(rf, m_width, m_height))
+        return false;
+    m_width = m_preFilter.width();
+    m_height = m_preFilter.height();
+
     m_alpha = static_cast<double>(rf.check("alpha", yarp::os::Value(1*M_PI)).asFloat64());
     m_ksize = static_cast<unsigned int>(rf.check("kSize", yarp::os::Value(3)).asInt32());
     m_sigma = static_cast<double>(rf.check("sigma", yarp::os::Value(0.3)).asFloat64());
@@ -110,11 +191,55 @@ bool RefConv::configure(yarp::os::ResourceFinder& rf)
     m_kernel = m_kernel*m_kernel.t();
     m_padSize = static_cast<int>((m_ksize-1)/2);
 
-    // Convolved image
-    // pads facilitate the border management
-    m_img = cv::Mat(m_height + 2*m_padSize, m_width + 2*m_padSize, CV_64F, cv::Scalar(0));
-    // SAE
-    m_sae = cv::Mat(m_height + 2*m_padSize, m_width + 2*m_padSize, CV_64F, cv::Scalar(0));
+    // with small kernels a single patch leaves most SIMD lanes of cv::exp idle
+    int batch = rf.check("batch", yarp::os::Value(0)).asInt32();
+    if(batch < 0)
+    {
+        yError() << "batch must not be negative";
+        return false;
+    }
+    m_batch = static_cast<unsigned int>(batch);
+
+    #ifdef INTERLEAVED
+        // SAE and convolved image interleaved, pads facilitate the border management
+        // a kernel row of (sae, img) pairs is contiguous: kSize rows span a few cache lines
+        m_state = cv::Mat(m_height + 2*m_padSize, m_width + 2*m_padSize, CV_64FC2, cv::Scalar(0, 0));
+        m_saeScratch = cv::Mat(m_ksize, m_ksize, CV_64F, cv::Scalar(0));
+    #else
+        // Convolved image
+        // pads facilitate the border management
+        m_img = cv::Mat(m_height + 2*m_padSize, m_width + 2*m_padSize, CV_64F, cv::Scalar(0));
+        // SAE
+        m_sae = cv::Mat(m_height + 2*m_padSize, m_width + 2*m_padSize, CV_64F, cv::Scalar(0));
+    #endif
+
+    // periodic checkpoint of the surfaces, restored on a warm restart
+    std::string checkpoint = rf.check("checkpoint", yarp::os::Value("")).asString();
+    m_checkpointing = !checkpoint.empty();
+    if(m_checkpointing)
+    {
+        #ifdef INTERLEAVED
+            std::vector<cv::Mat> surfaces = {m_state};
+        #else
+            std::vector<cv::Mat> surfaces = {m_sae, m_img};
+        #endif
+        if(!m_checkpoint.initialise(checkpoint, surfaces, &last_ts, rf.check("checkpointPeriod", yarp::os::Value(1.0)).asFloat64()))
+            return false;
+
+        double ts;
+        if(m_checkpoint.restore(ts, m_restoredAt))
+        {
+            // rebase the SAE so that the checkpoint happens at t=0, the first
+            // new event then continues at the downtime
+            #ifdef INTERLEAVED
+                m_state -= cv::Scalar(ts, 0);
+            #else
+                m_sae -= ts;
+            #endif
+            m_restored = true;
+            yInfo() << "Surfaces restored from" << checkpoint;
+        }
+    }
 
     #if LOG==0 || LOG==1 || LOG==2
         yInfo() << "Logging input port delay";
@@ -141,14 +266,21 @@ bool RefConv::configure(yarp::os::ResourceFinder& rf)
         log.open(logFileName, std::ofstream::out | std::ofstream::trunc);
     #endif
 
+    m_fps = static_cast<unsigned int>(rf.check("fps", yarp::os::Value(30)).asInt32());
+
+    // when to compute the snapshots, and a port to request them
+    if(!m_scheduler.configure(rf))
+        return false;
+    if(!m_rpcPort.open(getName() + "/rpc"))
+        return false;
+    attach(m_rpcPort);
+
     #ifdef VIS
-        m_fps = static_cast<unsigned int>(rf.check("fps", yarp::os::Value(30)).asInt32());
-        
-        // Create window for visualisation
-        cv::namedWindow(getName(), cv::WINDOW_NORMAL);
-        cv::resizeWindow(getName(), 800, 800);
-        cv::waitKey(1);
-        m = false;
+        // the render thread displays the latest snapshot at m_fps, skipping the others
+        m_render.initialise(getName(), m_fps, rf.check("visScale", yarp::os::Value(1.0)).asFloat64());
+        m_render.placement.configure(rf, "render");
+        m_render.placement.priority = 0; // the display never runs real-time
+        asapThread.render = &m_render;
     #endif
 
    // configure and start the baby thread
@@ -161,13 +293,32 @@ bool RefConv::configure(yarp::os::ResourceFinder& rf)
            m_height,
            m_width,
            m_padSize,
-           &m
+           &m_scheduler
            #if LOG==1
                , &data
            #endif
+           #ifdef INTERLEAVED
+               , m_state
+           #endif
            );
 
+    // lock the surfaces (already pre-faulted by their initialisation) in RAM
+    if(rf.check("mlock"))
+    {
+        if(!lockMemory())
+            return false;
+        // but not the replayed file
+        if(m_fromFile)
+            m_evFile.unlock();
+    }
+
     yInfo() << getName() << "module configured";
+    #ifdef VIS
+        if(!m_render.start())
+            return false;
+    #endif
+    if(m_checkpointing && !m_checkpoint.start())
+        return false;
     return Thread::start() && asapThread.start();
 }
 
@@ -178,6 +329,11 @@ double RefConv::getPeriod()
                                              
 bool RefConv::interruptModule()
 {
+    if(m_checkpointing)
+        m_checkpoint.stop();
+    #ifdef VIS
+        m_render.stop();
+    #endif
     return Thread::stop() && asapThread.stop();
 }
 
@@ -187,9 +343,7 @@ void RefConv::onStop()
     //close ports etc.
     m_inPort.close();   
     //m_inPort.releaseDataLock(); # Cant remember why we needed that
-    #ifdef VIS
-        m = false;
-    #endif
+    m_rpcPort.close();
     
     #if LOG==0
         for( auto d : data)
@@ -207,7 +361,6 @@ void RefConv::onStop()
         log.close();
     #endif 
         
-    cv::destroyAllWindows();    
     return;
 }
 
@@ -217,76 +370,216 @@ bool RefConv::updateModule()
     return Thread::isRunning() && asapThread.isRunning();
 }
 
+bool RefConv::respond(const yarp::os::Bottle& command, yarp::os::Bottle& reply)
+{
+    if(m_scheduler.respond(command, reply))
+        return true;
+    return RFModule::respond(command, reply);
+}
+
+void RefConv::decayCoefs(const AE &qi, double ts, cv::Mat &coefs)
+{
+    // Pad reminder: (xi,yi) in the SAE is the kernel starting point, not its center
+    #ifdef INTERLEAVED
+        // Gather the SAE patch and stamp it, px[0] is the SAE and px[1] the image
+        refPatchCoefsInterleaved<double>(m_state, qi, m_ksize, m_alpha, ts, m_saeScratch, coefs);
+    #else
+        // decay coefficient = -alpha*delta-time, then update the SAE
+        refPatchCoefs(m_sae, qi, m_ksize, m_alpha, ts, coefs);
+    #endif
+}
+
+void RefConv::updatePatch(const AE &qi, const cv::Mat &decay)
+{
+    // Decay the img and sum the current kernel
+    #ifdef INTERLEAVED
+        refPatchApplyInterleaved<double>(m_state, m_kernel, qi, decay);
+    #else
+        refPatchApply(m_img, m_kernel, qi, decay);
+    #endif
+}
+
+#if LOG==2
+void RefConv::logAccuracy(const AE &qi, double ts)
+{
+    cv::Mat img_window;
+    #ifdef INTERLEAVED
+        cv::extractChannel(m_state(cv::Rect(qi.x, qi.y, m_ksize, m_ksize)), img_window, 1);
+    #else
+        img_window = m_img(cv::Rect(qi.x, qi.y, m_ksize, m_ksize));
+    #endif
+    double energy = cv::norm(img_window, NORM_L1);
+    log << ts << ", " << img_window.at<double>(m_padSize, m_padSize) << ", " << energy << "\n";
+}
+#endif
+
 void RefConv::run()
 {
+    m_eventPlacement.apply();
+
     // using the vtsHelper for arith straight-forwardly was leanding to errors
     int maxTimestamp = static_cast<int>(ev::vtsHelper::max_stamp);
     
     Stamp yarpstamp;    
     
     // Allocating openCV matrices
-    cv::Mat saePatch = cv::Mat(m_ksize, m_ksize, CV_64F);
-    cv::Mat fsaePatch = cv::Mat(m_ksize, m_ksize, CV_64F);
     cv::Mat coefs  = cv::Mat(m_ksize, m_ksize, CV_64F);
     cv::Mat decay = cv::Mat(m_ksize, m_ksize, CV_64F);
-    cv::Mat img_window = cv::Mat(m_ksize, m_ksize, CV_64F);
+
+    // one row of kSize*kSize coefficients per event of a batch
+    cv::Mat batchCoefs = cv::Mat(std::max(m_batch, 1u), m_ksize*m_ksize, CV_64F);
+    cv::Mat batchDecay = cv::Mat(std::max(m_batch, 1u), m_ksize*m_ksize, CV_64F);
+    std::vector<double> batchTs(std::max(m_batch, 1u));
     
     int prev_tick = 0;
+
+    #ifdef PROFILE
+        PerfProfiler perf("event");
+        perf.open();
+        int pPreFilter = perf.addSection("preFilter", "event");
+        int pUpdate = perf.addSection("update", "event");
+        int pGather = perf.addSection("batch gather", "event");
+        int pExp = perf.addSection("batch exp", "event");
+        int pApply = perf.addSection("batch apply", "event");
+    #endif
     
     while(true)
     {
-        const vector<AE> * q = m_inPort.read(yarpstamp);
-        if(!q || Thread::isStopping()) return;              
+        EvSpan q;
+        if(m_fromFile)
+        {
+            if(!m_evFile.next(q, m_packetSize) || Thread::isStopping())
+            {
+                yInfo() << "End of the EVB file";
+                break;
+            }
+            yarpstamp.update();
+        }
+        else
+        {
+            const vector<AE> * qp = m_inPort.read(yarpstamp);
+            if(!qp || Thread::isStopping()) break;
+            q = EvSpan(*qp);
+        }
+
+        if(m_preFilter.enabled())
+        {
+            #ifdef PROFILE
+                perf.start();
+                size_t received = q.size();
+            #endif
+            q = m_preFilter.apply(q);
+            #ifdef PROFILE
+                perf.stop(pPreFilter, received);
+            #endif
+            if(q.empty()) continue;
+        }
+
+        // continue the timeline of the restored surfaces from the first event
+        if(m_restored && !q.empty())
+        {
+            // the downtime includes the wait for the source
+            last_ts = std::max(0.0, yarp::os::Time::now() - m_restoredAt);
+            prev_tick = q.begin()->stamp;
+            m_restored = false;
+            yInfo() << "Restored timeline continues after" << last_ts << "s";
+        }
         
         #if LOG==1
             double tic = yarp::os::Time::now();
         #endif
 
-        for(auto& qi:*q) // For each event
+        if(m_batch == 0)
         {
-            last_ts += ev::vtsHelper::deltaS(qi.stamp, prev_tick);
-            prev_tick = qi.stamp;
-
-            // Pad reminder: (xi,yi) in the SAE is the kernel starting point, not its center
-            // Get a reference to the SAE patch referring to the kernel
-            saePatch = m_sae(cv::Rect(qi.x, qi.y, m_ksize, m_ksize));
-            
-            // decay coefficient = -alpha*delta-time
-            coefs = m_alpha*(saePatch - last_ts);
-
-            // Calculate the decay
-            cv::exp(coefs, decay);
-
-            // Update SAE 
-            saePatch = last_ts;
-
-            // Pad reminder: (xi,yi) in the image is the kernel starting point, not its center
-            // get a reference to the image region referring to the kernel
-            img_window = m_img(cv::Rect(qi.x, qi.y, m_ksize, m_ksize));
-            // Decay the img and sum the current kernel
-            if(qi.polarity)
-                img_window = img_window.mul(decay) + m_kernel;
-            else
-                img_window = img_window.mul(decay) - m_kernel;
-
-            #if VIS
-                m = true;
+            #ifdef PROFILE
+                perf.start();
             #endif
 
-            #if LOG==2
-                double energy = cv::norm(img_window, NORM_L1);
-                log << last_ts << ", " << m_img.at<double>(qi.y+m_padSize, qi.x+m_padSize) << ", " << energy << "\n";
+            for(auto& qi:q) // For each event
+            {
+                last_ts += ev::vtsHelper::deltaS(qi.stamp, prev_tick);
+                prev_tick = qi.stamp;
+
+                decayCoefs(qi, last_ts, coefs);
+
+                // Calculate the decay
+                cv::exp(coefs, decay);
+
+                updatePatch(qi, decay);
+
+                #if LOG==2
+                    logAccuracy(qi, last_ts);
+                #endif
+            } //for(auto& qi:q)
+
+            #ifdef PROFILE
+                perf.stop(pUpdate, q.size());
             #endif
-        } //for(auto& qi:*q)
+        }
+        else
+        {
+            for(const AE *qb = q.begin(); qb != q.end(); )
+            {
+                int n = static_cast<int>(std::min<size_t>(m_batch, q.end() - qb));
+
+                #ifdef PROFILE
+                    perf.start();
+                #endif
+
+                // Gather the coefficients of the block in event order. The SAE is stamped
+                // as we go, so an event overlapping an earlier one of the block reads its
+                // timestamp, exactly as in event-by-event processing
+                for(int i = 0; i < n; i++)
+                {
+                    last_ts += ev::vtsHelper::deltaS(qb[i].stamp, prev_tick);
+                    prev_tick = qb[i].stamp;
+                    batchTs[i] = last_ts;
+
+                    cv::Mat rowCoefs = batchCoefs.row(i).reshape(1, m_ksize);
+                    decayCoefs(qb[i], last_ts, rowCoefs);
+                }
+                #ifdef PROFILE
+                    perf.lap(pGather, n);
+                #endif
+
+                // Calculate the decays of the whole block in one pass
+                refBlockDecays(batchCoefs, batchDecay, n);
+                #ifdef PROFILE
+                    perf.lap(pExp, n);
+                #endif
+
+                // Apply the kernels in event order, overlapping patches accumulate as before
+                for(int i = 0; i < n; i++)
+                {
+                    updatePatch(qb[i], batchDecay.row(i).reshape(1, m_ksize));
+
+                    #if LOG==2
+                        logAccuracy(qb[i], batchTs[i]);
+                    #endif
+                }
+                #ifdef PROFILE
+                    perf.stop(pApply, n);
+                #endif
+
+                qb += n;
+            }
+        }
+
+        // the packet is in the surfaces, let the scheduler decide on a snapshot
+        m_scheduler.events(q.size());
         
         #if LOG==0
-            data.push_back(std::tuple<double, double, double>(yarpstamp.getTime(), m_inPort.queryRate(), m_inPort.queryDelayT()));
+            if(!m_fromFile)
+                data.push_back(std::tuple<double, double, double>(yarpstamp.getTime(), m_inPort.queryRate(), m_inPort.queryDelayT()));
         #elif LOG==1
-            double avgtime = (yarp::os::Time::now()-tic)/q->size();
+            double avgtime = (yarp::os::Time::now()-tic)/q.size();
             data.push_back(std::tuple<int, double, double>(0, yarpstamp.getTime(), avgtime));
         #endif
     }
 
-
+    m_preFilter.report();
+    #ifdef PROFILE
+        perf.report();
+    #endif
 }
 // Empty lines, the way gcc likes
@@ -28,6 +28,17 @@
 #include <opencv2/imgproc/imgproc.hpp>
 #include <opencv2/features2d.hpp> // ORB descriptor and feature
 
+#include "evbFile.h"
+#include "threadPlacement.h"
+#include "renderThread.h"
+#include "surfaceCheckpoint.h"
+#include "snapshotScheduler.h"
+#include "preFilter.h"
+#include "convKernels.h"
+#ifdef PROFILE
+    #include "perfCounters.h"
+#endif
+
 #define _USE_MATH_DEFINES 
 #include <cmath>
 
@@ -53,11 +64,19 @@ class Update : public Thread {
 
 public:
     cv::Mat sae, img;
+    #ifdef INTERLEAVED
+        cv::Mat state; //!< interleaved (sae, img), split into sae and img for each snapshot
+    #endif
     std::string name;
     double alpha;
     double *img_ts;
-    cv::Mat coefs, decays, updated_img, norm_img; 
-    bool *mlock;
+    cv::Mat dt, decays, updated_img; //!< time since the last event, decays and decayed img
+    std::vector<cv::Mat> decayPlanes; //!< decays of the alpha, shares the data of decays
+    SnapshotScheduler *scheduler; //!< wakes this thread when a snapshot is due
+    ThreadPlacement placement; //!< cpu and priority of this thread
+    #ifdef VIS
+        Render *render; //!< display stage, fed with every snapshot
+    #endif
     std::vector<std::tuple<int, double, double>> *d;
     unsigned int width, height, padSize;
 
@@ -70,13 +89,21 @@ public:
             unsigned int m_height,
             unsigned int m_width,
             unsigned int m_padSize,
-            bool *m
+            SnapshotScheduler *m_scheduler
             #if LOG==1
                 , std::vector<std::tuple<int, double, double>> *data
             #endif
+            #ifdef INTERLEAVED
+                , cv::Mat &m_state
+            #endif
     );
     
     void run();
+
+    /*!
+     * Wake up the thread waiting for the next snapshot
+     */
+    void onStop();
 };
 
 /**
@@ -120,14 +147,49 @@ public:
      */
     bool updateModule();
 
+    /*!
+     * Rpc commands: "snapshot" computes a snapshot and replies once it is
+     * published, "stats" replies the snapshot rate and staleness.
+     */
+    bool respond(const yarp::os::Bottle& command, yarp::os::Bottle& reply);
+
 private:
+    /*!
+     * Decay coefficients (alpha*dt) of the kernel patch of an event, then
+     * stamps the patch in the SAE with ts.
+     */
+    void decayCoefs(const AE &qi, double ts, cv::Mat &coefs);
+
+    /*!
+     * Decays the image patch of an event and sums (or subtracts) the kernel.
+     */
+    void updatePatch(const AE &qi, const cv::Mat &decay);
+
+    #if LOG==2
+        void logAccuracy(const AE &qi, double ts);
+    #endif
+
     vReadPort< vector<AE> > m_inPort; //!< port to receive the events
+    EvbReader m_evFile; //!< memory mapped EVB file, replaces m_inPort if given
+    bool m_fromFile{false}; //!< read the events from m_evFile
+    PreFilter m_preFilter; //!< flip, crop and noise filter of the incoming packets
+    ThreadPlacement m_eventPlacement; //!< cpu and priority of the event thread
+
+    SurfaceCheckpoint m_checkpoint; //!< periodic copy of the surfaces for warm restarts
+    bool m_checkpointing{false}; //!< m_checkpoint is running
+    bool m_restored{false}; //!< surfaces restored, the next event continues their timeline
+    double m_restoredAt{0.0}; //!< wall clock time of the restored checkpoint
+    unsigned int m_packetSize; //!< events per packet when reading from file
     
     unsigned int m_width; //!< image width
     unsigned int m_height; //!< image height
 
     cv::Mat m_img; //!< Matrix that the convolved image 
     cv::Mat m_sae; //!< Saves the timestamp of the last event in each image position
+    #ifdef INTERLEAVED
+        cv::Mat m_state; //!< CV_64FC2 (sae, img) per pixel, replaces m_sae and m_img
+        cv::Mat m_saeScratch; //!< contiguous copy of an SAE patch
+    #endif
     double last_ts{0.0}; //!< timestamp of the last event
     
     double m_alpha; //!< Cut frequency for high-pass filter
@@ -135,6 +197,7 @@ private:
     double m_sigma; //!< convolution kernel sigma 
     cv::Mat m_kernel; //!< convolution kernel
     unsigned int m_padSize; //!< kernel ofsset from centre
+    unsigned int m_batch; //!< events whose decays are computed in one pass, 0 for event-by-event
 
     #if LOG==0 || LOG==1 || LOG==2
         std::string logFileName; //<! path to the scores log file
@@ -153,13 +216,12 @@ private:
     // baby thread 
     Update asapThread;
 
-    #if VIS
-        cv::Mat coefs; //no pad img size
-        cv::Mat decays; // idem
-        cv::Mat updated_img; // idem
-        cv::Mat norm_img; //idem
-        bool m{false};
-        unsigned int m_fps;
+    SnapshotScheduler m_scheduler; //!< when the snapshots are computed
+    yarp::os::RpcServer m_rpcPort; //!< snapshot requests and statistics
+    unsigned int m_fps; //!< display rate
+
+    #ifdef VIS
+        Render m_render; //!< displays the snapshots at m_fps
     #endif
 };
 